@@ -0,0 +1,95 @@
+/*
+ * Functions of the malloc library beyond the standard malloc interface.
+ * Include this file in programs that use them, malloc.h is internal to the
+ * library.
+ *
+ * Author: Savan Patel
+ * Email : patel.sav@husky.neu.edu
+ *
+ */
+
+#ifndef _LIBMALLOC_H
+#define _LIBMALLOC_H 1
+
+#include <stddef.h>
+
+
+/*
+ * malloc statistics, filled in by get_malloc_statistics().
+ */
+typedef struct malloc_statistics
+{
+   // total arena size allocated in bytes.
+   unsigned long total_arena_size_allocated;
+
+   // total size allocated through mmap system call.
+   unsigned long total_mmap_size_allocated;
+
+   // total size of large blocks given back to the system with munmap.
+   unsigned long total_mmap_size_released;
+
+   // total number of blocks in heap.
+   unsigned long total_number_of_blocks;
+
+   // total number of allocation done. It is count of number of times malloc
+   // called
+   unsigned long total_allocation_request;
+
+   // total free requests made.
+   unsigned long total_free_request;
+
+   // total number of free blocks available (of all threads.)
+   // a heap may hold a negative count when its thread frees blocks that
+   // other threads allocated, the sum is exact.
+   unsigned long total_free_blocks;
+}malloc_statistics;
+
+
+
+
+/*
+ * Frees a block whose requested size is known, without looking up its kind.
+ * params: pointer returned by malloc, calloc or realloc, requested size.
+ * returns: NONE.
+ */
+void free_sized(void *p, size_t size);
+
+
+
+
+/*
+ * Frees a block from aligned_alloc whose alignment and size are known.
+ * params: pointer returned by aligned_alloc, its alignment and size.
+ * returns: NONE.
+ */
+void free_aligned_sized(void *p, size_t alignment, size_t size);
+
+
+
+
+/*
+ * nallocx flags: MALLOCX_LG_ALIGN(la) asks for 2^la byte alignment,
+ * MALLOCX_ALIGN(a) for a power of two a.
+ */
+#define MALLOCX_LG_ALIGN_MASK 0x3f
+#define MALLOCX_LG_ALIGN(la)  ((int)(la))
+#define MALLOCX_ALIGN(a)      ((int)__builtin_ctzl(a))
+
+/*
+ * Returns the usable size an allocation of size bytes would get, without
+ * allocating.
+ * params: requested size, MALLOCX_LG_ALIGN() flags or 0.
+ * returns: rounded size in bytes, 0 if the request can't be served.
+ */
+size_t nallocx(size_t size, int flags);
+
+
+
+
+/*
+ * Reads malloc statistics, summed over the heaps of all threads.
+ * params: statistics to fill in.
+ */
+void get_malloc_statistics(malloc_statistics *stats);
+
+#endif
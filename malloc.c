@@ -1,10 +1,11 @@
 /*
  * Implements malloc library in C.
  * This malloc implemtation has per thread bins.
- * bins are according to four sizes:
- * 8 bytes, 64 bytes, 512 bytes and greated than 512 bytes.
+ * Small requests are rounded up to a size class, every size class has its
+ * own bin. Requests greater than 3584 bytes share one bin.
  *
- * memory for size > 512 bytes is allocated through mmap system call.
+ * memory for size > 3584 bytes up to 256 KB is carved as page runs from the
+ * heap, bigger blocks are allocated through mmap system call.
  * memory blocks are initialized lazily and are appended on free list after
  * free() call.
  *
@@ -30,427 +31,3744 @@ void *align8(void *x)
 
 
 /*
- *  returns the pointer to elated bin based on the size.
- *  params: size of bin.
- *  returns: pointer to bin corresponding size.
+ * Maps a small request size (<= SMALL_SIZE_MAX) to its size class index.
+ * params: requested size in bytes.
+ * returns: index into size_class_size and small_bins.
  */
-block_info** get_bin(size_t size)
+unsigned int size_to_class(size_t size)
 {
-    switch(size)
-    {
-       case 8   : return &bin_8;
-       case 64  : return &bin_64;
-       case 512 : return &bin_512;
-       default  : return &bin_large;
-    }
+    return size_class_lookup[(size + 15) >> 4];
 }
 
 
 /*
- *  Creates a memory block from unused heap.
- *  params: requested memory size in bytes.
- *  returns: pointer to allocated memory chunk. NULL on failure.
+ * Finds the smallest size class holding size bytes whose blocks are aligned
+ * to alignment. Blocks are aligned to the largest power of two dividing
+ * their class size, so 64 byte alignment is served by the 64, 128, 192, ...
+ * classes without any padding.
+ * params: requested size (<= SMALL_SIZE_MAX), alignment (power of two).
+ * returns: size class index, NUM_SIZE_CLASSES when no class fits.
  */
-void * block_from_unused_heap(size_t size)
+unsigned int aligned_size_class(size_t size, size_t alignment)
 {
-    /*If thread heap is not initialized or if available free size is less
-      than the block for requested size.*/
-    if(NULL == thread_unused_heap_start ||
-       (thread_heap_end - thread_unused_heap_start) <
-           (size + sizeof(block_info)))
-    {
-
-        /*If heap of process is not initialized or available free size of general
-          heap is less than the block for requested size.*/
-        if(NULL == heap_used_memory_end ||
-            (sbrk(0) - heap_used_memory_end) < (size + sizeof(block_info)))
-        {
-            /*If heap is not initialized.*/
-            if(NULL == heap_used_memory_end)
-            {
-                heap_used_memory_end = sbrk(0);
-                if(heap_used_memory_end == (void*) -1)
-                {
-                    errno = ENOMEM;
-                    perror("\n sbrk(0) failed.");
-                    return NULL;
-                }
-            }
-
-            align8(heap_used_memory_end);
-        }
+    unsigned int size_class = size_to_class(size);
 
-        // extend heap, return NULL on failure.
-        if(sbrk(sysconf(_SC_PAGESIZE) * 100) == (void *) -1)
+    while(size_class < NUM_SIZE_CLASSES)
+    {
+        unsigned int class_size = size_class_size[size_class];
+        if((class_size & -class_size) >= alignment)
         {
-            errno = ENOMEM;
-            perror("\n sbrk failed to extend heap.");
-            return NULL;
+            break;
         }
-
-        /*If there is smaller chunk remaining, add to free list of a bin.
-          to minimize the wastage of memory.*/
-        /*if(NULL != thread_unused_heap_start)
-        {
-            // TODO: add_chunk_to_bin(); possible optimization.
-        }*/
-
-        /*create fresh heap of 1 page size. for a thread.*/
-        thread_unused_heap_start = heap_used_memory_end;
-        thread_heap_end =
-            heap_used_memory_end + (sysconf(_SC_PAGESIZE));
-        heap_used_memory_end =  thread_heap_end;
+        size_class++;
     }
+    return size_class;
+}
 
-    block_info b;
-    b.size = size;
-    b.next = NULL;
-
-    memcpy(thread_unused_heap_start, &b, sizeof(block_info));
-    thread_unused_heap_start += (sizeof(block_info) + size);
 
-    // update stats variables.
-    pthread_mutex_lock(&stats_mutex);
-    total_number_of_blocks++;
-    total_arena_size_allocated += size;
-    pthread_mutex_unlock(&stats_mutex);
+/*
+ * returns the slab holding a small block.
+ * params: pointer to a block inside the heap.
+ * returns: slab header at the start of the first page of the slab.
+ */
+slab_info * slab_of(void *p)
+{
+    void *page = (void *)((unsigned long)p & ~(unsigned long)(SLAB_SIZE - 1));
+    chunk_info *chunk = chunk_of(page);
 
-    return (thread_unused_heap_start - size);
+    return page - (unsigned long)chunk->slab_page[
+                      (page - (void *)chunk) / SLAB_SIZE] * SLAB_SIZE;
 }
 
 
+/*
+ * returns the index of a block inside its slab.
+ * params: slab of the block and pointer to the block.
+ * returns: block index, the bit of the block in slab->free_map.
+ */
+unsigned int slab_block_index(slab_info *slab, void *p)
+{
+    unsigned int size_class = slab->size_class;
+    unsigned long offset =
+        (unsigned long)(p - (void *)slab) - size_class_first_block[size_class];
+
+    return (unsigned int)((offset * size_class_div_magic[size_class]) >> 32);
+}
 
 
 /*
- * Allocate memory from heap area. For memory request of sizes < 512, chunks are
- * allocated from heap.
- * params : size.
- * returns: pointer to allocated area.
+ * returns the chunk holding an address.
+ * params: any address.
+ * returns: chunk_info of the chunk, NULL if p is not inside a chunk.
  */
-void *heap_allocate(size_t size)
+chunk_info * chunk_lookup(void *p)
 {
+    unsigned long index = (unsigned long)p >> CHUNK_SHIFT;
+    chunk_info **leaf;
 
-   block_info **bin = get_bin(size);
-   void * ret = NULL;
-   /* reuse memory block from heap bins if available*/
-   if(NULL != *bin)
-   {
-       block_info *p = *bin;
-       *bin =  p->next;
-       p->next = NULL;
-
-       pthread_mutex_lock(&stats_mutex);
-       total_free_blocks--;
-       pthread_mutex_unlock(&stats_mutex);
-       ret = (void *)((char*)p + sizeof(block_info));
-   }
-   else  //request new memory or slice out remaining unused memory.
-   {     pthread_mutex_lock(&global_heap_mutex);
-         ret =  block_from_unused_heap(size);
-         pthread_mutex_unlock(&global_heap_mutex);
-   }
+    if(index >> CHUNK_MAP_BITS)
+    {
+        return NULL;
+    }
 
-   return ret;
+    leaf = __atomic_load_n(&chunk_map[index >> CHUNK_MAP_LEAF_BITS],
+                           __ATOMIC_ACQUIRE);
+    if(NULL == leaf)
+    {
+        return NULL;
+    }
+    return __atomic_load_n(&leaf[index & ((1UL << CHUNK_MAP_LEAF_BITS) - 1)],
+                           __ATOMIC_ACQUIRE);
 }
 
 
-
 /*
-  Finds best fitting block from large memory bin.
-*/
-void * find_best_fit_from_bin_large(size_t size)
+ * Records a chunk in the chunk map. Called with global_heap_mutex held.
+ * params: chunk to add, or NULL to remove the entry of address p.
+ * returns: 0 on success, -1 if a leaf of the map can't be mapped.
+ */
+int chunk_map_set(void *p, chunk_info *chunk)
 {
-    block_info *b = bin_large;
-    block_info *best_fit = NULL;
-    int min_fit_size = INT_MAX;
-    void *ret = NULL;
+    unsigned long index = (unsigned long)p >> CHUNK_SHIFT;
+    chunk_info **leaf;
 
-    while(b != NULL)
+    if(index >> CHUNK_MAP_BITS)
     {
-         if(b->size >= size && b->size < min_fit_size)
-         {
-            best_fit = b;
-            min_fit_size = b->size;
-         }
-         b = b->next;
+        return -1;
     }
 
-    /*If best fit found, update list*/
-    if(NULL != best_fit)
+    leaf = chunk_map[index >> CHUNK_MAP_LEAF_BITS];
+    if(NULL == leaf)
     {
-        // if best_fit is first block.
-        if (best_fit == bin_large)
-        {
-           bin_large = bin_large->next;
-           best_fit->next = NULL;
-           ret = (void *)((void *)best_fit + sizeof(block_info));
-        }
-        else
+        leaf = mmap(NULL,
+                    sizeof(chunk_info *) << CHUNK_MAP_LEAF_BITS,
+                    PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS| MAP_PRIVATE,
+                    -1,
+                    0);
+        if(leaf == MAP_FAILED)
         {
-          b = bin_large;
-          while(b != NULL && b->next != best_fit)
-          {
-            b = b->next;
-          }
-          if(b != NULL)
-          {
-             b->next = best_fit->next;
-          }
-          best_fit->next = NULL;
-          ret = (void *)((void *)best_fit + sizeof(block_info));
+            return -1;
         }
+        __atomic_store_n(&chunk_map[index >> CHUNK_MAP_LEAF_BITS], leaf,
+                         __ATOMIC_RELEASE);
     }
 
-    return ret;
+    __atomic_store_n(&leaf[index & ((1UL << CHUNK_MAP_LEAF_BITS) - 1)], chunk,
+                     __ATOMIC_RELEASE);
+    return 0;
 }
 
 
-
-
 /*
- * maps new memory address using mmap system call for size
- * request > 512 bytes.
- * Requests kernel to map new memory at some place decided by kernel.
- * params: requested size in bytes.
- * returns: pointer to block allocated., NULL on failure.
+ * Reserves a new chunk. Called with global_heap_mutex held.
+ * mmap gives no alignment guarantee, so twice the size is reserved and the
+ * unaligned head and tail are unmapped again. With transparent_hugepages
+ * the whole chunk is committed, one mapping the kernel can back with a
+ * huge page.
+ * returns: new chunk, NULL on failure.
  */
-void * mmap_new_memory(size_t size)
+chunk_info * new_chunk(void)
 {
-    int num_pages =
-        ((size + sizeof(block_info) - 1)/sysconf(_SC_PAGESIZE)) + 1;
-    int required_page_size = sysconf(_SC_PAGESIZE) * num_pages;
+    void *reserved = mmap(NULL,
+                          2 * CHUNK_SIZE,
+                          PROT_NONE,
+                          MAP_ANONYMOUS| MAP_PRIVATE| MAP_NORESERVE,
+                          -1,
+                          0);
+    if(reserved == MAP_FAILED)
+    {
+        return NULL;
+    }
 
-    void *ret = mmap(NULL, // let kernel decide.
-                     required_page_size,
-                     PROT_READ | PROT_WRITE,
-                     MAP_ANONYMOUS| MAP_PRIVATE,
-                     -1, //no file descriptor
-                     0); //offset.
+    void *start = (void *)(((unsigned long)reserved + CHUNK_SIZE - 1) &
+                           ~(CHUNK_SIZE - 1));
+    if(start != reserved)
+    {
+        munmap(reserved, start - reserved);
+    }
+    munmap(start + CHUNK_SIZE, reserved + CHUNK_SIZE - start);
 
-    block_info b;
-    b.size = (required_page_size - sizeof(block_info));
-    b.next = NULL;
+    chunk_info *chunk = start;
+    size_t commit = transparent_hugepages ? CHUNK_SIZE : CHUNK_COMMIT_STEP;
+    if(mprotect(start, commit, PROT_READ | PROT_WRITE) != 0)
+    {
+        munmap(start, CHUNK_SIZE);
+        return NULL;
+    }
+    if(transparent_hugepages)
+    {
+        // fails without THP support, the chunk then uses small pages.
+        madvise(start, CHUNK_SIZE, MADV_HUGEPAGE);
+    }
+    chunk->committed_end = start + commit;
+    chunk->frontier = SLAB_SIZE;
 
-    ret = memcpy(ret, &b, sizeof(block_info));
-    ret = ((char*)ret + sizeof(block_info));
+    if(chunk_map_set(chunk, chunk) != 0)
+    {
+        munmap(start, CHUNK_SIZE);
+        return NULL;
+    }
 
-    // update stats variables.
-    pthread_mutex_lock(&stats_mutex);
-    total_mmap_size_allocated += size;
-    pthread_mutex_unlock(&stats_mutex);
+    chunk->next_chunk = all_chunks;
+    all_chunks = chunk;
 
-    return ret;
+    return chunk;
 }
 
 
 /*
- * Performs allocation for request > 512 bytes.
- * params : requested memory size.
- * returns: pointer to allocated memory. NULL on failure.
+ * Unmaps a chunk whose pages are all free. Called with global_heap_mutex
+ * held.
+ * params: chunk to release.
  */
-void *alloc_large(size_t size)
+void release_chunk(chunk_info *chunk)
 {
-   void * ret = NULL;
-   if(NULL != bin_large)
-   {
-       //pthread_mutex_lock(&global_heap_mutex);
-       ret = find_best_fit_from_bin_large(size);
-      // pthread_mutex_unlock(&global_heap_mutex);
-   }
+    chunk_info **link = &all_chunks;
 
-   /*either bin_large is empty or no best fit was found.*/
-   if(ret == NULL)
-   {
-       //pthread_mutex_lock(&global_heap_mutex);
-       ret = mmap_new_memory(size);
-      // pthread_mutex_unlock(&global_heap_mutex);
-   }
-    return ret;
+    while(NULL != *link && *link != chunk)
+    {
+        link = &(*link)->next_chunk;
+    }
+    if(NULL != *link)
+    {
+        *link = chunk->next_chunk;
+    }
+    if(heap_current_chunk == chunk)
+    {
+        __atomic_store_n(&heap_current_chunk, NULL, __ATOMIC_RELEASE);
+    }
+
+    chunk_map_set(chunk, NULL);
+    munmap(chunk, CHUNK_SIZE);
 }
 
 
 /*
- * Allocates the memory.
+ * returns the chunk holding a pointer.
+ * params: pointer inside a chunk.
+ * returns: chunk_info of the chunk.
  */
-void* malloc(size_t size)
+chunk_info * chunk_of(void *p)
 {
-     pthread_mutex_lock(&stats_mutex);
-     total_allocation_request++;
-     pthread_mutex_unlock(&stats_mutex);
+    return (chunk_info *)((unsigned long)p & ~(CHUNK_SIZE - 1));
+}
 
-     void * ret = NULL;
 
-     if(size < 0)
-     {
-        perror("\n Invalid memory request.");
-        return NULL;
-     }
+/*
+ * Makes pages of a chunk read/write up to end. The committed range only
+ * grows from the start of the chunk, in CHUNK_COMMIT_STEP steps, so the
+ * committed part stays one mapping. Threads check committed_end without a
+ * lock and only call this, with global_heap_mutex held, when it is short.
+ * params: chunk, end of the range to commit.
+ * returns: 0 on success, -1 on failure.
+ */
+int commit_pages(chunk_info *chunk, void *end)
+{
+    if(end <= chunk->committed_end)
+    {
+        return 0;
+    }
 
-     // allocate from either large bin or mmap.
-     if(size > 512)
-     {  //printf("Alloc large\n");
-        ret = alloc_large(size);
-     }
-     else
-     {
-       size = (size <= 8)? 8 : ((size<=64)? 64: 512);
-       ret = heap_allocate(size);
-     }
-     return ret;
+    void *new_end = (void *)(((unsigned long)end + CHUNK_COMMIT_STEP - 1) &
+                             ~(CHUNK_COMMIT_STEP - 1));
+    if(new_end > (void *)chunk + CHUNK_SIZE)
+    {
+        new_end = (void *)chunk + CHUNK_SIZE;
+    }
+    if(mprotect(chunk->committed_end, new_end - chunk->committed_end,
+                PROT_READ | PROT_WRITE) != 0)
+    {
+        return -1;
+    }
+    __atomic_store_n(&chunk->committed_end, new_end, __ATOMIC_RELEASE);
+    return 0;
 }
 
 
-
 /*
- * Free up the memory allocated at pointer p. It appends the block into free
- * list.
- * params: address to pointer to be freed.
- * returns: NONE.
+ * Gives pages back to the kernel. They stay reserved and read/write, and
+ * read zero on the next touch. MADV_DONTNEED keeps the committed range one
+ * mapping, which dropping the access rights again would split.
+ * params: page aligned start and length.
  */
-void free(void *p)
+void decommit_pages(void *start, size_t length)
 {
-   //update stats variables.
-   pthread_mutex_lock(&stats_mutex);
-   total_free_request++;
-   total_free_blocks++;
-   pthread_mutex_unlock(&stats_mutex);
-
-   if(NULL != p)
-   {
-      block_info *block  = (block_info *)(p - sizeof(block_info));
-      memset(p, '\0', block->size);
+    madvise(start, length, MADV_DONTNEED);
+}
 
-      block_info **bin = get_bin(block->size);
-      block_info *check_bin = *bin;
 
-      // already freed?
-      while(check_bin != NULL)
-      {
-         if(check_bin == block)
-         {
-            return;
-         }
-         check_bin = check_bin->next;
-      }
+/*
+ * Checks if a pointer was handed out from a slab of the heap.
+ * Slabs live in chunks, blocks > SMALL_SIZE_MAX are either medium blocks
+ * in chunks, starting sizeof(block_info) bytes into a page or in a page
+ * marked SLAB_PAGE_ALIGNED, or mapped on their own.
+ * params: pointer returned by malloc.
+ * returns: 1 if p is a small block, 0 otherwise.
+ */
+int is_small_block(void *p)
+{
+    chunk_info *chunk = chunk_lookup(p);
 
-      // attach as head to free list of corresponding bin.
-      block->next = *bin;
-      *bin = block;
-    }
+    return (NULL != chunk &&
+            ((unsigned long)p & (SLAB_SIZE - 1)) != sizeof(block_info) &&
+            SLAB_PAGE_ALIGNED !=
+                chunk->slab_page[(p - (void *)chunk) / SLAB_SIZE]);
 }
 
 
-/*similar to calloc of glibc */
-void *calloc(size_t nmemb, size_t size)
+/*
+ * Checks if a block with a block_info header is a medium block.
+ * params: block header.
+ * returns: 1 if the block lives in a chunk, 0 if it is mapped on its own.
+ */
+int is_medium_block(block_info *block)
 {
-     void *p = malloc(nmemb * size);
-     block_info *b = (block_info *)(p - sizeof(block_info));
-     memset(p, '\0', b->size);
-     return p;
+    return (NULL != chunk_lookup(block));
 }
 
 
-
-
 /*
- * Allocate size of size bytes for nmemb. Initialize with null bytes.
- * params: total number of elements of size 'size' to be allocated.
- *         and size to allocate.
- * returns: pointer to allocated memory on success. NULL on failure.
- */void *realloc(void *ptr, size_t size)
+ * returns the usable size of a block returned by malloc.
+ * params: pointer returned by malloc.
+ * returns: size of the block in bytes.
+ */
+size_t block_size(void *p)
 {
-    if(NULL == ptr)
+    if(is_small_block(p))
     {
-       return malloc(size);
+        return size_class_size[slab_of(p)->size_class];
     }
-    void *newptr = malloc(size);
+    return ((block_info *)(p - sizeof(block_info)))->size;
+}
 
-    if(NULL == newptr)
+
+/*
+ * Carves the next thread heap out of the current chunk without a lock.
+ * The range is claimed with a fetch-add on the chunk frontier, so threads
+ * refilling at the same time get disjoint ranges. The one thread whose
+ * range crosses the chunk end keeps the shorter tail, if it holds size.
+ * Everybody past the end installs a new chunk: the first one to take
+ * global_heap_mutex maps it and publishes it in heap_current_chunk, the
+ * others see the chunk changed and retry on it. The mutex is also taken to
+ * commit pages when the range is past committed_end. Both only happen when
+ * the process grows. A thread whose range crosses the chunk end but can't
+ * use the tail gives it to free_slices, so the whole chunk can become one
+ * free run. chunk_carvers counts the threads that may still touch the chunk
+ * they loaded, malloc_trim() doesn't unmap chunks while it is not zero.
+ * params: bytes needed (<= CHUNK_SIZE - SLAB_SIZE), set to the range end.
+ * returns: start of the new thread heap, NULL on failure.
+ */
+void * carve_thread_heap(size_t size, void **end)
+{
+    size_t slice_size = (size > THREAD_HEAP_SIZE)? size : THREAD_HEAP_SIZE;
+
+    for(;;)
     {
-        return NULL;
-    }
-    block_info *old_block =
-        (block_info *)((char*)ptr - sizeof(block_info));
+        __atomic_fetch_add(&chunk_carvers, 1, __ATOMIC_SEQ_CST);
+        chunk_info *chunk = __atomic_load_n(&heap_current_chunk,
+                                            __ATOMIC_SEQ_CST);
+        if(NULL != chunk)
+        {
+            unsigned long offset = __atomic_fetch_add(&chunk->frontier,
+                                                      slice_size,
+                                                      __ATOMIC_RELAXED);
+            if(offset + size <= CHUNK_SIZE)
+            {
+                /* the last thread heap of a chunk may be shorter. */
+                unsigned long end_offset = offset + slice_size;
+                if(end_offset > CHUNK_SIZE)
+                {
+                    end_offset = CHUNK_SIZE;
+                }
 
-    memcpy(newptr, ptr, old_block->size);
+                void *start = (void *)chunk + offset;
+                *end = (void *)chunk + end_offset;
 
-    free(ptr);
+                int ret = 0;
+                if(*end > __atomic_load_n(&chunk->committed_end,
+                                          __ATOMIC_ACQUIRE))
+                {
+                    pthread_mutex_lock(&global_heap_mutex);
+                    ret = commit_pages(chunk, *end);
+                    pthread_mutex_unlock(&global_heap_mutex);
+                }
+                __atomic_fetch_sub(&chunk_carvers, 1, __ATOMIC_SEQ_CST);
+                if(ret != 0)
+                {
+                    errno = ENOMEM;
+                    return NULL;
+                }
+                return start;
+            }
 
-    return newptr;
+            if(offset < CHUNK_SIZE)
+            {
+                pthread_mutex_lock(&global_heap_mutex);
+                if(0 == commit_pages(chunk, (void *)chunk + CHUNK_SIZE))
+                {
+                    put_free_run((void *)chunk + offset,
+                                 (void *)chunk + CHUNK_SIZE, RUN_CLEAN, 0);
+                }
+                pthread_mutex_unlock(&global_heap_mutex);
+            }
+        }
+        __atomic_fetch_sub(&chunk_carvers, 1, __ATOMIC_SEQ_CST);
+
+        /* chunk used up (or none yet): grow the global heap. */
+        pthread_mutex_lock(&global_heap_mutex);
+        if(heap_current_chunk == chunk)
+        {
+            chunk_info *fresh = new_chunk();
+            if(NULL == fresh)
+            {
+                pthread_mutex_unlock(&global_heap_mutex);
+                errno = ENOMEM;
+                return NULL;
+            }
+            __atomic_store_n(&heap_current_chunk, fresh, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&global_heap_mutex);
+    }
 }
 
 
 /*
- * Fork hook. This will be called before fork happens.
- * The method holds lock so as to make sure none of the active threads
- * are holding lock and thus making sure, none of the threads are
- * in middle of malloc process.
- * later child hooks can reset the mutex to initial value.
+ * Sets the boundary tags of a free run, on its first and last page, to its
+ * length in pages, or clears them.
+ * params: page aligned range inside one chunk, length in pages or 0.
  */
-void prep_fork(void)
+void set_run_tags(void *start, void *end, unsigned short pages)
 {
-    // take lock before fork so as to make sure no other thread is
-    // holding lock.
-    pthread_mutex_lock(&global_heap_mutex);
+    chunk_info *chunk = (chunk_info *)((unsigned long)start &
+                                       ~(CHUNK_SIZE - 1));
+
+    chunk->free_run[(start - (void *)chunk) / SLAB_SIZE] = pages;
+    chunk->free_run[(end - (void *)chunk) / SLAB_SIZE - 1] = pages;
 }
 
 
 /*
- * Since mutex is held by prep_fork method, it can safely be reset
- * in parent process.
+ * Removes a free run from free_slices. Called with global_heap_mutex held.
+ * params: run to remove.
  */
-void parent_fork_handle(void)
+void unlink_free_run(heap_slice *slice)
 {
-  pthread_mutex_init(&global_heap_mutex, NULL);
+    if(RUN_CLEAN != slice->state)
+    {
+        free_dirty_bytes -= slice->end - (void *)slice;
+    }
+    if(NULL != slice->next)
+    {
+        slice->next->prev = slice->prev;
+    }
+    if(NULL != slice->prev)
+    {
+        slice->prev->next = slice->next;
+    }
+    else
+    {
+        __atomic_store_n(&free_slices, slice->next, __ATOMIC_RELEASE);
+    }
 }
 
 
 /*
- * Since mutex is held by prep_fork method, it can safely be reset
- * in child process.
+ * Folds the state of a free run into the state of a run it is merged with.
+ * params: state and time of the merged run, run merged into it.
  */
-void child_fork_handle(void)
+void merge_run_state(int *state, unsigned long *changed_at, heap_slice *run)
 {
-   pthread_mutex_init(&global_heap_mutex, NULL);
+    if(run->state > *state ||
+       (run->state == *state && run->changed_at > *changed_at))
+    {
+        *state = run->state;
+        *changed_at = run->changed_at;
+    }
 }
 
 
-
 /*
- * Global constructor to Initialize the fork hooks
+ * Gives a range of pages back to free_slices. The tag on the page before
+ * the range tells the length of the free run ending there, the tag on the
+ * page after it the length of the free run starting there. Both are merged
+ * with the range if they are RUN_CLEAN just when it is, the tags left
+ * inside the merged run are cleared. A dirty range is not merged into a
+ * clean run, which would make the whole run count as dirty and be
+ * decommitted again. Pages in use, or not carved yet, carry no tag. The
+ * merged run takes the dirtiest state of its parts, and the latest time
+ * among the parts in that state. Called with global_heap_mutex held.
+ * params: page aligned range inside one chunk, RUN_CLEAN if it is zero
+ *         filled, RUN_MUZZY or RUN_DIRTY, time in ms it got that state.
+ * returns: the free run the range ended up in.
  */
-__attribute__((constructor)) void sharedLibConstructor(void)
+heap_slice * put_free_run(void *start, void *end, int state,
+                          unsigned long changed_at)
 {
-  int ret =
-      pthread_atfork(&prep_fork,
-                     &parent_fork_handle,
-                     &child_fork_handle);
-  if (ret != 0)
-  {
-      perror("pthread_atfork() error [Call #1]. Malloc is now not fork safe.");
-  }
+    chunk_info *chunk = (chunk_info *)((unsigned long)start &
+                                       ~(CHUNK_SIZE - 1));
+    unsigned long first = (start - (void *)chunk) / SLAB_SIZE;
+    unsigned long after = (end - (void *)chunk) / SLAB_SIZE;
 
-  /*if(mcheck(NULL) != 0)
-  {  TODO: mcheck implemtation.
-      perror("\n mcheck failed");
-  }*/
+    chunk->free_pages += after - first;
 
-}
+    // the first page holds chunk_info and never has a tag.
+    unsigned short pages = chunk->free_run[first - 1];
+    heap_slice *left = start - (unsigned long)pages * SLAB_SIZE;
+    if(0 != pages && (RUN_CLEAN == left->state) == (RUN_CLEAN == state))
+    {
+        merge_run_state(&state, &changed_at, left);
+        unlink_free_run(left);
+        set_run_tags(left, start, 0);
+        // only read: a page dropped before isn't faulted in again.
+        if(NULL != ((heap_slice *)start)->end)
+        {
+            memset(start, 0, sizeof(heap_slice));
+        }
+        start = left;
+    }
 
+    heap_slice *right = end;
+    if(after < CHUNK_PAGES && 0 != chunk->free_run[after] &&
+       (RUN_CLEAN == right->state) == (RUN_CLEAN == state))
+    {
+        void *right_end = right->end;
+        merge_run_state(&state, &changed_at, right);
+        unlink_free_run(right);
+        set_run_tags(right, right_end, 0);
+        memset(right, 0, sizeof(heap_slice));
+        end = right_end;
+    }
 
-void *memalign(size_t alignment, size_t s)
-{
-    return heap_used_memory_end;
+    heap_slice *slice = start;
+    slice->end = end;
+    slice->state = state;
+    slice->changed_at = changed_at;
+    slice->prev = NULL;
+    slice->next = free_slices;
+    if(NULL != free_slices)
+    {
+        free_slices->prev = slice;
+    }
+    set_run_tags(start, end, (end - start) / SLAB_SIZE);
+    if(RUN_CLEAN != state)
+    {
+        free_dirty_bytes += end - start;
+    }
+    __atomic_store_n(&free_slices, slice, __ATOMIC_RELEASE);
+    return slice;
 }
 
 
-void malloc_stats()
+/*
+ * Takes memory for a thread heap from the first free run that holds size.
+ * With transparent_hugepages it is the run that holds size in the chunk
+ * with the fewest free pages instead, so allocations fill up the busiest
+ * huge pages and the emptiest ones can become free. A run longer than a
+ * thread heap is split and the rest stays free.
+ * Called with global_heap_mutex held.
+ * params: bytes needed (a multiple of SLAB_SIZE), set to the end of the
+ *         range, set to the state of the run it came from.
+ * returns: start of the range, NULL if no free run is big enough. Only its
+ *          first sizeof(heap_slice) bytes may not be zero if the run was
+ *          RUN_CLEAN.
+ */
+void * take_free_run(size_t size, void **end, int *state)
 {
+    heap_slice *slice = NULL;
+
+    for(heap_slice *run = free_slices; NULL != run; run = run->next)
+    {
+        if((size_t)(run->end - (void *)run) >= size &&
+           (NULL == slice ||
+            chunk_of(run)->free_pages < chunk_of(slice)->free_pages))
+        {
+            slice = run;
+            if(!transparent_hugepages)
+            {
+                break;
+            }
+        }
+    }
+    if(NULL == slice)
+    {
+        return NULL;
+    }
+
+    void *run_end = slice->end;
+    *state = slice->state;
+    unlink_free_run(slice);
+    set_run_tags(slice, run_end, 0);
+    chunk_of(slice)->free_pages -= (run_end - (void *)slice) / SLAB_SIZE;
+
+    size_t take = (size > THREAD_HEAP_SIZE)? size : THREAD_HEAP_SIZE;
+    *end = run_end;
+    if((size_t)(run_end - (void *)slice) > take)
+    {
+        *end = (void *)slice + take;
+        put_free_run(*end, run_end, slice->state, slice->changed_at);
+    }
+    return slice;
+}
+
+
+/*
+ * Decommits a free run in place and marks it RUN_CLEAN. The header page is
+ * dropped too, so the header is written again. Called with
+ * global_heap_mutex held.
+ * params: run in free_slices.
+ */
+void decommit_free_run(heap_slice *slice)
+{
+    heap_slice header = *slice;
+
+    if(RUN_CLEAN != header.state)
+    {
+        free_dirty_bytes -= header.end - (void *)slice;
+    }
+    decommit_pages(slice, header.end - (void *)slice);
+    *slice = header;
+    slice->state = RUN_CLEAN;
+    slice->changed_at = 0;
+}
+
+
+/*
+ * Checks if the free pages of a chunk may be given back to the kernel.
+ * With transparent_hugepages that breaks up the huge page of the chunk,
+ * so only once HUGEPAGE_BREAK_PAGES of its pages are free.
+ * params: pointer inside the chunk.
+ * returns: 1 if they may, 0 if the huge page is kept whole.
+ */
+int may_break_hugepage(void *p)
+{
+    return (!transparent_hugepages ||
+            chunk_of(p)->free_pages >= HUGEPAGE_BREAK_PAGES);
+}
+
+
+/*
+ * Takes free runs that are not RUN_CLEAN, and whose chunk
+ * may_break_hugepage() allows, out of free_slices until free_dirty_bytes
+ * is down to keep bytes. free_slices is most recently freed first, so the
+ * oldest runs are taken, from the end of the list, and pages freed last,
+ * the likeliest to be used again, stay. Up to PURGE_BATCH runs at a time
+ * are decommitted without global_heap_mutex and put back RUN_CLEAN with
+ * one more lock. Their bounds are kept on the stack meanwhile, a header
+ * written into a dropped page would fault it in again.
+ * params: dirty bytes to keep.
+ */
+void decommit_dirty_runs(size_t keep)
+{
+    void *runs[PURGE_BATCH][2];
+    size_t count = 0;
+
+    do
+    {
+        count = 0;
+        pthread_mutex_lock(&global_heap_mutex);
+        heap_slice *slice = free_slices;
+        while(NULL != slice && NULL != slice->next)
+        {
+            slice = slice->next;
+        }
+        while(NULL != slice && free_dirty_bytes > keep &&
+              count < PURGE_BATCH)
+        {
+            heap_slice *prev = slice->prev;
+            if(RUN_CLEAN != slice->state && may_break_hugepage(slice))
+            {
+                runs[count][0] = slice;
+                runs[count][1] = slice->end;
+                unlink_free_run(slice);
+                set_run_tags(slice, runs[count][1], 0);
+                chunk_of(slice)->free_pages -=
+                    (runs[count][1] - (void *)slice) / SLAB_SIZE;
+                count++;
+            }
+            slice = prev;
+        }
+        // runs it had to skip don't count against the next pass.
+        dirty_purge_at = dirty_max +
+                         (free_dirty_bytes > keep ? free_dirty_bytes - keep : 0);
+        pthread_mutex_unlock(&global_heap_mutex);
+
+        for(size_t i = 0; i < count; i++)
+        {
+            decommit_pages(runs[i][0], runs[i][1] - runs[i][0]);
+        }
+
+        pthread_mutex_lock(&global_heap_mutex);
+        for(size_t i = 0; i < count; i++)
+        {
+            put_free_run(runs[i][0], runs[i][1], RUN_CLEAN, 0);
+        }
+        pthread_mutex_unlock(&global_heap_mutex);
+    } while(PURGE_BATCH == count);
+}
+
+
+/*
+ * Gives pages no longer used by a thread heap (an empty slab or a medium
+ * block) back to free_slices. They go back RUN_DIRTY, so pages reused soon
+ * are not faulted in again. With background purging purge_thread() purges
+ * them later. Otherwise, once free_dirty_bytes passes dirty_purge_at, the
+ * oldest dirty runs are decommitted in one pass, merged with their
+ * neighbours by then, until half of dirty_max is left. With
+ * transparent_hugepages only runs of chunks that are mostly free are
+ * decommitted (see may_break_hugepage()).
+ * In per-CPU mode a heap passed is locked, the work waits for
+ * unlock_heap(), so global_heap_mutex is not taken under the spin lock.
+ * params: heap of the calling thread (may be NULL), page aligned range
+ *         inside one chunk.
+ */
+void release_heap_pages(thread_heap *heap, void *start, void *end)
+{
+    release_heap_ranges(heap, &start, 1, end - start);
+}
+
+
+/*
+ * Gives several ranges of the same length back to free_slices, dirty, with
+ * one lock of global_heap_mutex, like release_heap_pages().
+ * params: heap of the calling thread (may be NULL), starts of page aligned
+ *         ranges inside a chunk each, their number, their length.
+ */
+void release_heap_ranges(thread_heap *heap, void **starts,
+                         unsigned int count, size_t length)
+{
+    unsigned long now = now_ms();
+    int purge = 0;
+
+#ifdef PER_CPU_HEAPS
+    // given back once the lock of the CPU heap is let go.
+    if(NULL != heap)
+    {
+        for(unsigned int i = 0; i < count; i++)
+        {
+            heap_slice *run = starts[i];
+            run->end = starts[i] + length;
+            run->next = heap->deferred_runs;
+            heap->deferred_runs = run;
+        }
+        return;
+    }
+#endif
+
+    pthread_mutex_lock(&global_heap_mutex);
+    for(unsigned int i = 0; i < count; i++)
+    {
+        put_free_run(starts[i], starts[i] + length, RUN_DIRTY, now);
+    }
+    if(!background_purge)
+    {
+        purge = (free_dirty_bytes > dirty_purge_at);
+    }
+    pthread_mutex_unlock(&global_heap_mutex);
+
+    if(purge)
+    {
+        decommit_dirty_runs(dirty_max / 2);
+    }
+}
+
+
+/*
+ * Moves every free run whose decay time passed one state towards
+ * RUN_CLEAN: a run RUN_DIRTY for dirty_decay_ms is given to the kernel with
+ * MADV_FREE, which reclaims the pages only when it is short of memory, and
+ * a run RUN_MUZZY for muzzy_decay_ms is dropped with MADV_DONTNEED. The run
+ * is taken out of free_slices while the syscall runs, so
+ * global_heap_mutex is not held for it. Without MADV_FREE runs are
+ * dropped right away. With transparent_hugepages runs of chunks that are
+ * mostly in use are left alone (see may_break_hugepage()).
+ * params: current time in ms.
+ */
+void purge_free_runs(unsigned long now)
+{
+    for(;;)
+    {
+        pthread_mutex_lock(&global_heap_mutex);
+        heap_slice *slice = free_slices;
+        while(NULL != slice &&
+              ((!(RUN_DIRTY == slice->state &&
+                  slice->changed_at + dirty_decay_ms <= now) &&
+                !(RUN_MUZZY == slice->state &&
+                  slice->changed_at + muzzy_decay_ms <= now)) ||
+               !may_break_hugepage(slice)))
+        {
+            slice = slice->next;
+        }
+        if(NULL == slice)
+        {
+            pthread_mutex_unlock(&global_heap_mutex);
+            return;
+        }
+
+        void *start = slice;
+        void *end = slice->end;
+        int state = slice->state;
+        unlink_free_run(slice);
+        set_run_tags(start, end, 0);
+        chunk_of(start)->free_pages -= (end - start) / SLAB_SIZE;
+        pthread_mutex_unlock(&global_heap_mutex);
+
+        if(RUN_DIRTY == state && 0 == madvise(start, end - start, MADV_FREE))
+        {
+            state = RUN_MUZZY;
+        }
+        else
+        {
+            decommit_pages(start, end - start);
+            state = RUN_CLEAN;
+        }
+
+        pthread_mutex_lock(&global_heap_mutex);
+        put_free_run(start, end, state, now_ms());
+        pthread_mutex_unlock(&global_heap_mutex);
+    }
+}
+
+
+/*
+ * Body of the background purging thread. It wakes up every quarter of the
+ * shorter decay time, within PURGE_INTERVAL_MIN_MS and
+ * PURGE_INTERVAL_MAX_MS, or when purge_wake is signalled, expires the huge
+ * cache and purges free runs, so none of that work is done by malloc() or
+ * free().
+ * params: unused.
+ * returns: never.
+ */
+void * purge_thread(void *arg)
+{
+    unsigned long interval = (dirty_decay_ms < muzzy_decay_ms ?
+                              dirty_decay_ms : muzzy_decay_ms) / 4;
+    if(interval < PURGE_INTERVAL_MIN_MS)
+    {
+        interval = PURGE_INTERVAL_MIN_MS;
+    }
+    if(interval > PURGE_INTERVAL_MAX_MS)
+    {
+        interval = PURGE_INTERVAL_MAX_MS;
+    }
+
+    for(;;)
+    {
+        struct timespec wake_at;
+        clock_gettime(CLOCK_REALTIME, &wake_at);
+        wake_at.tv_sec += interval / 1000;
+        wake_at.tv_nsec += (interval % 1000) * 1000000;
+        if(wake_at.tv_nsec >= 1000000000)
+        {
+            wake_at.tv_sec++;
+            wake_at.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&global_heap_mutex);
+        pthread_cond_timedwait(&purge_wake, &global_heap_mutex, &wake_at);
+        unsigned long now = now_ms();
+        huge_entry *expired = huge_cache_expire(now);
+        pthread_mutex_unlock(&global_heap_mutex);
+        release_huge_entries(NULL, expired);
+
+        purge_free_runs(now);
+    }
+    return NULL;
+}
+
+
+/*
+ *  Creates a memory block from unused heap.
+ *  Blocks are carved from the thread heap without a lock. When the thread
+ *  heap is used up, a thread heap left by an exited thread is reused, or
+ *  the next THREAD_HEAP_SIZE bytes of the current chunk become the thread
+ *  heap (see carve_thread_heap()).
+ *  params: requested memory size in bytes, a multiple of SLAB_SIZE.
+ *  returns: pointer to allocated memory chunk (SLAB_SIZE aligned).
+ *           NULL on failure.
+ */
+void * block_from_unused_heap(size_t size)
+{
+    /*If thread heap is not initialized or if available free size is less
+      than the block for requested size.*/
+    if(NULL == thread_unused_heap_start ||
+       (thread_heap_end - thread_unused_heap_start) < size)
+    {
+        if(size > CHUNK_SIZE - SLAB_SIZE)
+        {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        /* the tail too short for this request is given back, it can still
+           serve smaller ones. Then reuse free runs first. The list is only
+           locked when there is something to do. */
+        void *start = NULL;
+        void *end = NULL;
+        int state = RUN_CLEAN;
+        int has_tail = (NULL != thread_unused_heap_start &&
+                        thread_heap_end - thread_unused_heap_start >=
+                        SLAB_SIZE);
+        if(has_tail ||
+           NULL != __atomic_load_n(&free_slices, __ATOMIC_ACQUIRE))
+        {
+            pthread_mutex_lock(&global_heap_mutex);
+            if(has_tail)
+            {
+                put_free_run(thread_unused_heap_start, thread_heap_end,
+                             thread_heap_dirty ? RUN_DIRTY : RUN_CLEAN,
+                             now_ms());
+            }
+            start = take_free_run(size, &end, &state);
+            pthread_mutex_unlock(&global_heap_mutex);
+        }
+        thread_unused_heap_start = NULL;
+        thread_heap_end = NULL;
+        thread_heap_dirty = 0;
+
+        if(NULL != start)
+        {
+            thread_unused_heap_start = start;
+            thread_heap_end = end;
+            thread_heap_dirty = (RUN_CLEAN != state);
+            memset(start, 0, sizeof(heap_slice));
+        }
+        else
+        {
+            start = carve_thread_heap(size, &end);
+            if(NULL == start)
+            {
+                return NULL;
+            }
+            thread_unused_heap_start = start;
+            thread_heap_end = end;
+        }
+    }
+
+    void *ret = thread_unused_heap_start;
+    thread_unused_heap_start += size;
+
+    return ret;
+}
+
+
+/*
+ * Creates thread_heap_key. Called once.
+ */
+void create_thread_heap_key(void)
+{
+#ifdef PER_CPU_HEAPS
+    if(pthread_key_create(&thread_heap_key, &thread_slice_exit) != 0)
+#else
+    if(pthread_key_create(&thread_heap_key, &thread_heap_exit) != 0)
+#endif
+    {
+        perror("pthread_key_create() error. Thread heaps leak on thread exit.");
+    }
+}
+
+
+/*
+ * Maps a new empty heap and links it in all_heaps. Called with
+ * global_heap_mutex held.
+ * returns: new heap, NULL on failure.
+ */
+thread_heap * create_heap(void)
+{
+    thread_heap *heap = mmap(NULL,
+                             sizeof(thread_heap),
+                             PROT_READ | PROT_WRITE,
+                             MAP_ANONYMOUS| MAP_PRIVATE,
+                             -1,
+                             0);
+    if(heap == MAP_FAILED)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    heap->next_heap = all_heaps;
+    __atomic_store_n(&all_heaps, heap, __ATOMIC_RELEASE);
+    return heap;
+}
+
+
+/*
+ * returns the heap of the calling thread, creating it on first use.
+ * A heap abandoned by an exited thread is adopted if there is one.
+ * Heaps are never unmapped, other threads may still push blocks on
+ * remote_free of a heap.
+ * returns: heap of the thread, NULL on failure.
+ */
+thread_heap * get_thread_heap(void)
+{
+    if(NULL != current_heap)
+    {
+        return current_heap;
+    }
+
+    pthread_once(&thread_heap_key_once, &create_thread_heap_key);
+
+    pthread_mutex_lock(&global_heap_mutex);
+    thread_heap *heap = abandoned_heaps;
+    int created = (NULL == heap);
+    if(created)
+    {
+        heap = create_heap();
+    }
+    else
+    {
+        abandoned_heaps = heap->abandoned_next;
+        heap->abandoned_next = NULL;
+    }
+    pthread_mutex_unlock(&global_heap_mutex);
+
+    if(NULL == heap)
+    {
+        return NULL;
+    }
+
+    // set before pthread_setspecific, which may call malloc.
+    current_heap = heap;
+    pthread_setspecific(thread_heap_key, heap);
+
+    /* an adopted heap keeps the bins of its previous thread. */
+    if(created)
+    {
+        prepopulate_bins(heap);
+    }
+    return heap;
+}
+
+
+/*
+ * Thread key destructor. Carves the rest of the current slabs into the
+ * bins and sweeps every class in use, so empty slabs are given back and
+ * the free blocks go to the transfer caches in whole batches. Gives the
+ * unused part of the thread heap back to free_slices, unmaps the cached
+ * large blocks and leaves the heap with the last few blocks of each bin
+ * on abandoned_heaps. Blocks other threads still free to the heap keep
+ * landing on its remote_free queue, the thread adopting the heap reclaims
+ * them.
+ * params: heap of the exiting thread.
+ */
+void thread_heap_exit(void *arg)
+{
+    thread_heap *heap = arg;
+    unsigned int fl, sl;
+
+    reclaim_remote_free(heap);
+    for(unsigned int c = 0; c < NUM_SIZE_CLASSES; c++)
+    {
+        while(NULL != heap->current_slab[c])
+        {
+            refill_bin(heap, c);
+        }
+        // only a class with empty slabs not released yet is worth a sweep.
+        if(heap->sweep_credit[c] > 0)
+        {
+            heap->sweep_credit[c] = 0;
+            sweep_small_class(heap, c, 0);
+        }
+        while(heap->bin_count[c] >= TRANSFER_BATCH)
+        {
+            flush_bin(heap, c);
+        }
+    }
+
+    for(fl = 0; fl < LARGE_FL_COUNT; fl++)
+    {
+        for(sl = 0; sl < LARGE_SL_COUNT; sl++)
+        {
+            block_info *block = heap->bin_large.bins[fl][sl];
+            while(NULL != block)
+            {
+                block_info *next = block->next;
+                release_large_block(heap, block);
+                block = next;
+            }
+            heap->bin_large.bins[fl][sl] = NULL;
+        }
+        heap->bin_large.sl_map[fl] = 0;
+    }
+    heap->bin_large.fl_map = 0;
+    heap->bin_large.bytes = 0;
+
+    release_thread_slice();
+
+    pthread_mutex_lock(&global_heap_mutex);
+    heap->abandoned_next = abandoned_heaps;
+    abandoned_heaps = heap;
+    pthread_mutex_unlock(&global_heap_mutex);
+
+    current_heap = NULL;
+}
+
+
+/*
+ * Gives the unused rest of the thread heap slice of the calling thread back
+ * to free_slices.
+ */
+void release_thread_slice(void)
+{
+    pthread_mutex_lock(&global_heap_mutex);
+    if(NULL != thread_unused_heap_start &&
+       thread_heap_end - thread_unused_heap_start >= SLAB_SIZE)
+    {
+        put_free_run(thread_unused_heap_start, thread_heap_end,
+                     thread_heap_dirty ? RUN_DIRTY : RUN_CLEAN, now_ms());
+    }
+    pthread_mutex_unlock(&global_heap_mutex);
+
+    thread_unused_heap_start = NULL;
+    thread_heap_end = NULL;
+    thread_heap_dirty = 0;
+}
+
+
+#ifdef PER_CPU_HEAPS
+/*
+ * thread_heap_key destructor in per-CPU mode. CPU heaps stay, only the
+ * slice of the thread is given back.
+ * params: unused.
+ */
+void thread_slice_exit(void *arg)
+{
+    release_thread_slice();
+}
+
+
+/*
+ * returns the CPU the calling thread runs on. The kernel keeps cpu_id up to
+ * date in the rseq area glibc registers for the thread, so it is one load.
+ */
+unsigned int current_cpu(void)
+{
+    if(__rseq_size > 0)
+    {
+        struct rseq *rs = (struct rseq *)((char *)__builtin_thread_pointer() +
+                                          __rseq_offset);
+        int cpu = (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+        if(cpu >= 0)
+        {
+            return cpu % MAX_CPU_HEAPS;
+        }
+    }
+
+    int cpu = sched_getcpu();
+    return (cpu < 0) ? 0 : cpu % MAX_CPU_HEAPS;
+}
+
+
+/*
+ * returns the heap of a CPU, creating it on first use with the bins of the
+ * smallest classes filled, like a new thread heap.
+ * params: CPU index.
+ * returns: heap of the CPU, NULL on failure.
+ */
+thread_heap * get_cpu_heap(unsigned int cpu)
+{
+    thread_heap *heap = __atomic_load_n(&cpu_heaps[cpu], __ATOMIC_ACQUIRE);
+    if(NULL != heap)
+    {
+        return heap;
+    }
+
+    int created = 0;
+    pthread_mutex_lock(&global_heap_mutex);
+    heap = cpu_heaps[cpu];
+    if(NULL == heap)
+    {
+        heap = create_heap();
+        if(NULL != heap)
+        {
+            heap_lock(heap);
+            created = 1;
+        }
+        __atomic_store_n(&cpu_heaps[cpu], heap, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&global_heap_mutex);
+
+    /* filled under its lock, other threads of the CPU wait for it. */
+    if(created)
+    {
+        prepopulate_bins(heap);
+        unlock_heap(heap);
+    }
+    return heap;
+}
+
+
+/*
+ * Takes the spin lock of a CPU heap. The holder is normally the only
+ * thread on that CPU, so it is rarely contended, the waiter yields the CPU
+ * after HEAP_LOCK_SPINS tries in case the holder was preempted.
+ * params: heap to lock.
+ */
+void heap_lock(thread_heap *heap)
+{
+    unsigned int spins = 0;
+
+    while(__atomic_exchange_n(&heap->lock, 1, __ATOMIC_ACQUIRE))
+    {
+        while(__atomic_load_n(&heap->lock, __ATOMIC_RELAXED))
+        {
+            if(++spins < HEAP_LOCK_SPINS)
+            {
+#if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+#endif
+            }
+            else
+            {
+                sched_yield();
+            }
+        }
+    }
+}
+
+
+/*
+ * Gives back the page ranges and unmaps the blocks deferred under the lock
+ * of a CPU heap, after the lock is let go. The ranges are put in
+ * free_slices under one lock of global_heap_mutex, then the dirty runs are
+ * decommitted if they passed dirty_purge_at, like release_heap_ranges().
+ * params: ranges linked through next with their end in end, like free
+ *         runs, blocks linked through next. Either may be NULL.
+ */
+void flush_deferred(heap_slice *run, block_info *block)
+{
+    if(NULL != run)
+    {
+        unsigned long now = now_ms();
+        int purge = 0;
+
+        pthread_mutex_lock(&global_heap_mutex);
+        while(NULL != run)
+        {
+            heap_slice *next = run->next;
+            put_free_run(run, run->end, RUN_DIRTY, now);
+            run = next;
+        }
+        if(!background_purge)
+        {
+            purge = (free_dirty_bytes > dirty_purge_at);
+        }
+        pthread_mutex_unlock(&global_heap_mutex);
+
+        if(purge)
+        {
+            decommit_dirty_runs(dirty_max / 2);
+        }
+    }
+
+    while(NULL != block)
+    {
+        block_info *next = block->next;
+        munmap((void *)block - block->lead,
+               block->lead + sizeof(block_info) + block->size);
+        block = next;
+    }
+}
+#endif
+
+
+/*
+ * Returns the heap the calling thread allocates from. In per-CPU mode that
+ * is the heap of its CPU, returned locked.
+ * params: 0 to not create a thread heap (free() never does).
+ * returns: heap to use, may be NULL. Must be passed to unlock_heap().
+ */
+thread_heap * lock_heap(int create)
+{
+#ifdef PER_CPU_HEAPS
+    /* register the slice destructor before any lock is held,
+       pthread_setspecific may call malloc. */
+    if(!thread_key_set)
+    {
+        thread_key_set = 1;
+        pthread_once(&thread_heap_key_once, &create_thread_heap_key);
+        pthread_setspecific(thread_heap_key, &thread_key_set);
+    }
+
+    thread_heap *heap = get_cpu_heap(current_cpu());
+    if(NULL != heap)
+    {
+        heap_lock(heap);
+    }
+    return heap;
+#else
+    return create ? get_thread_heap() : current_heap;
+#endif
+}
+
+
+/*
+ * Releases a heap returned by lock_heap(). The work deferred under the lock
+ * of a CPU heap is done right after.
+ * params: heap returned by lock_heap(), may be NULL.
+ */
+void unlock_heap(thread_heap *heap)
+{
+#ifdef PER_CPU_HEAPS
+    if(NULL != heap)
+    {
+        heap_slice *runs = heap->deferred_runs;
+        block_info *unmaps = heap->deferred_unmaps;
+
+        if(NULL == runs && NULL == unmaps)
+        {
+            __atomic_store_n(&heap->lock, 0, __ATOMIC_RELEASE);
+            return;
+        }
+        heap->deferred_runs = NULL;
+        heap->deferred_unmaps = NULL;
+        __atomic_store_n(&heap->lock, 0, __ATOMIC_RELEASE);
+        flush_deferred(runs, unmaps);
+    }
+#endif
+}
+
+
+/*
+ * Takes the lock of a CPU heap again after unlock_heap(), around a slow
+ * path that needs no heap state. Does nothing with thread heaps.
+ * params: heap returned by lock_heap().
+ */
+void relock_heap(thread_heap *heap)
+{
+#ifdef PER_CPU_HEAPS
+    heap_lock(heap);
+#endif
+}
+
+
+/*
+ * Hands a block freed by another thread to its owner heap.
+ * Lock free, can be called from any thread. The block is linked through
+ * its first word, like blocks in the bins.
+ * params: owner heap, and pointer to block already marked free.
+ */
+void push_remote_free(thread_heap *heap, void *p)
+{
+    free_block *block = p;
+    free_block *head = __atomic_load_n(&heap->remote_free, __ATOMIC_RELAXED);
+
+    do
+    {
+        block->next = head;
+    }
+    while(!__atomic_compare_exchange_n(&heap->remote_free, &head, block, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/*
+ * Moves all blocks freed by other threads back to the bins of the heap.
+ * Must be called by the owning thread. The whole queue is taken with one
+ * atomic exchange, so producers are never blocked.
+ * params: heap of the calling thread.
+ * returns: number of blocks reclaimed.
+ */
+int reclaim_remote_free(thread_heap *heap)
+{
+    int count = 0;
+    free_block *block;
+
+    if(NULL == __atomic_load_n(&heap->remote_free, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+
+    block = __atomic_exchange_n(&heap->remote_free, NULL, __ATOMIC_ACQUIRE);
+    while(NULL != block)
+    {
+        free_block *next = block->next;
+
+        if(is_small_block(block))
+        {
+            unsigned int size_class = slab_of(block)->size_class;
+            free_block **bin = &heap->small_bins[size_class];
+            block->next = *bin;
+            *bin = block;
+            if(++heap->bin_count[size_class] > BIN_HIGH_WATER)
+            {
+                flush_bin(heap, size_class);
+            }
+        }
+        else
+        {
+            cache_large_block(heap,
+                (block_info *)((void *)block - sizeof(block_info)));
+        }
+        count++;
+        block = next;
+    }
+
+    return count;
+}
+
+
+/*
+ * Takes a fresh slab for a size class from the thread heap. The lock of a
+ * CPU heap is let go meanwhile.
+ * params: owner heap, size class index.
+ * returns: initialized slab, NULL on failure.
+ */
+slab_info * new_slab(thread_heap *heap, unsigned int size_class)
+{
+    unsigned int pages = size_class_pages[size_class];
+
+    // may take global_heap_mutex and commit or map memory.
+    unlock_heap(heap);
+    slab_info *slab = block_from_unused_heap(pages * SLAB_SIZE);
+    relock_heap(heap);
+
+    if(NULL == slab)
+    {
+        return NULL;
+    }
+
+    chunk_info *chunk = chunk_of(slab);
+    unsigned long first = ((void *)slab - (void *)chunk) / SLAB_SIZE;
+    for(unsigned int i = 0; i < pages; i++)
+    {
+        chunk->slab_page[first + i] = i;
+    }
+
+    slab->size_class = size_class;
+    slab->next_unused = 0;
+    slab->dirty = thread_heap_dirty;
+    slab->owner = heap;
+    memset(slab->free_map, 0xff, sizeof(slab->free_map));
+
+    return slab;
+}
+
+
+
+
+/*
+ * Gives the pages of a slab back to free_slices once all its blocks are
+ * free, so memory freed in one size class serves any other class and
+ * thread. The blocks must all be unlinked first, which is only possible
+ * when they are all in the bin of the calling heap. Otherwise the blocks
+ * of the slab count towards the next sweep of the class, which also
+ * reaches the blocks in the transfer cache. A slab with blocks in other
+ * bins stays until it is emptied there.
+ * params: heap of the calling thread, slab.
+ */
+void release_empty_slab(thread_heap *heap, slab_info *slab)
+{
+    unsigned int size_class = slab->size_class;
+    unsigned int num_blocks = size_class_num_blocks[size_class];
+
+    /* blocks never carved are marked free too, and the owner may still
+       carve into a slab that is not fully carved. */
+    if(__atomic_load_n(&slab->next_unused, __ATOMIC_RELAXED) != num_blocks)
+    {
+        return;
+    }
+    for(unsigned int i = 0; i < SLAB_MAP_WORDS; i++)
+    {
+        if(__atomic_load_n(&slab->free_map[i], __ATOMIC_RELAXED) != ~0UL)
+        {
+            return;
+        }
+    }
+
+    unsigned int found = 0;
+    if(heap->bin_count[size_class] >= num_blocks)
+    {
+        for(free_block *block = heap->small_bins[size_class]; NULL != block;
+            block = block->next)
+        {
+            if(slab_of(block) == slab)
+            {
+                found++;
+            }
+        }
+    }
+    if(found != num_blocks)
+    {
+        // a sweep walks the bin and the whole transfer cache.
+        unsigned long walk = heap->bin_count[size_class] + TRANSFER_BATCH *
+            __atomic_load_n(&transfer_caches[size_class].batches,
+                            __ATOMIC_RELAXED);
+        heap->sweep_credit[size_class] += num_blocks;
+        if(8UL * heap->sweep_credit[size_class] >= 7UL * walk)
+        {
+            heap->sweep_credit[size_class] = 0;
+            sweep_small_class(heap, size_class, BIN_HIGH_WATER / 2);
+        }
+        return;
+    }
+
+    // unlink the blocks, fresh ones are the last bin_fresh of the bin.
+    unsigned int fresh_from = heap->bin_count[size_class] -
+                              heap->bin_fresh[size_class];
+    unsigned int position = 0;
+    free_block **link = &heap->small_bins[size_class];
+    while(NULL != *link)
+    {
+        if(slab_of(*link) == slab)
+        {
+            if(position >= fresh_from)
+            {
+                heap->bin_fresh[size_class]--;
+            }
+            *link = (*link)->next;
+        }
+        else
+        {
+            link = &(*link)->next;
+        }
+        position++;
+    }
+    heap->bin_count[size_class] -= num_blocks;
+
+    // update stats variables.
+    STATS_ADD(heap, total_number_of_blocks, -(long)num_blocks);
+    STATS_ADD(heap, total_arena_size_allocated,
+              -(long)num_blocks * size_class_size[size_class]);
+    STATS_ADD(heap, total_free_blocks, -(long)num_blocks);
+
+    release_heap_pages(heap, slab, (void *)slab +
+                                   size_class_pages[size_class] * SLAB_SIZE);
+}
+
+
+/*
+ * Finds the entry of a slab in a sweep table, adding it if it is not
+ * there yet. Slabs are hashed by page number with linear probing.
+ * params: table of SWEEP_SLABS entries, slab.
+ * returns: entry of the slab, NULL if the SWEEP_PROBES slots from its hash
+ *          are taken by other slabs.
+ */
+sweep_entry * sweep_lookup(sweep_entry *table, slab_info *slab)
+{
+    unsigned long slot = (unsigned long)slab / SLAB_SIZE;
+
+    for(unsigned int i = 0; i < SWEEP_PROBES; i++, slot++)
+    {
+        sweep_entry *entry = &table[slot & (SWEEP_SLABS - 1)];
+        if(NULL == entry->slab)
+        {
+            entry->slab = slab;
+        }
+        if(entry->slab == slab)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Sweeps a size class: the transfer cache is emptied on top of the bin of
+ * the calling heap, so the fresh blocks stay last, and the blocks of every
+ * slab are counted. Slabs with all their blocks there are unlinked and
+ * their pages given back to free_slices. The other blocks go back to the
+ * transfer cache in whole batches from the top of the bin, until fewer
+ * than keep + TRANSFER_BATCH are left.
+ * params: heap of the calling thread, size class index, blocks to keep in
+ *         the bin.
+ * returns: number of slabs released.
+ */
+unsigned int sweep_small_class(thread_heap *heap, unsigned int size_class,
+                               unsigned int keep)
+{
+    unsigned int num_blocks = size_class_num_blocks[size_class];
+    sweep_entry table[SWEEP_SLABS];
+    free_block *batch;
+
+    while(NULL != (batch = transfer_pop(size_class)))
+    {
+        free_block *last = batch;
+        while(NULL != last->next)
+        {
+            last = last->next;
+        }
+        last->next = heap->small_bins[size_class];
+        heap->small_bins[size_class] = batch;
+        heap->bin_count[size_class] += TRANSFER_BATCH;
+        STATS_ADD(heap, total_free_blocks, TRANSFER_BATCH);
+    }
+    memset(table, 0, sizeof(table));
+    for(free_block *block = heap->small_bins[size_class]; NULL != block;
+        block = block->next)
+    {
+        sweep_entry *entry = sweep_lookup(table, slab_of(block));
+        if(NULL != entry)
+        {
+            entry->count++;
+        }
+    }
+
+    // unlink, fresh ones are the last bin_fresh of the bin.
+    unsigned int fresh_from = heap->bin_count[size_class] -
+                              heap->bin_fresh[size_class];
+    unsigned int position = 0;
+    free_block **link = &heap->small_bins[size_class];
+    while(NULL != *link)
+    {
+        sweep_entry *entry = sweep_lookup(table, slab_of(*link));
+        if(NULL != entry && num_blocks == entry->count)
+        {
+            if(position >= fresh_from)
+            {
+                heap->bin_fresh[size_class]--;
+            }
+            heap->bin_count[size_class]--;
+            *link = (*link)->next;
+        }
+        else
+        {
+            link = &(*link)->next;
+        }
+        position++;
+    }
+
+    void *slabs[SWEEP_SLABS];
+    unsigned int released = 0;
+    for(unsigned int i = 0; i < SWEEP_SLABS; i++)
+    {
+        if(NULL != table[i].slab && num_blocks == table[i].count)
+        {
+            slabs[released++] = table[i].slab;
+        }
+    }
+    if(released > 0)
+    {
+        release_heap_ranges(heap, slabs, released,
+                            size_class_pages[size_class] * SLAB_SIZE);
+    }
+
+    // update stats variables.
+    STATS_ADD(heap, total_number_of_blocks, -(long)(released * num_blocks));
+    STATS_ADD(heap, total_arena_size_allocated,
+              -(long)released * num_blocks * size_class_size[size_class]);
+    STATS_ADD(heap, total_free_blocks, -(long)(released * num_blocks));
+
+    while(heap->bin_count[size_class] >= keep + TRANSFER_BATCH)
+    {
+        flush_bin(heap, size_class);
+    }
+    return released;
+}
+
+
+/*
+ * Pushes a batch of TRANSFER_BATCH linked blocks on the transfer cache of a
+ * class. The batch is published with one compare and swap of the head.
+ * params: size class index, first block of the batch.
+ */
+void transfer_push(unsigned int size_class, free_block *batch)
+{
+   transfer_cache *cache = &transfer_caches[size_class];
+   unsigned long head = __atomic_load_n(&cache->head, __ATOMIC_RELAXED);
+   unsigned long new_head;
+
+   do
+   {
+       batch->next_batch = (free_block *)(head & TRANSFER_PTR_MASK);
+       new_head = ((head & ~TRANSFER_PTR_MASK) + TRANSFER_TAG_ONE) |
+                  (unsigned long)batch;
+   }
+   while(!__atomic_compare_exchange_n(&cache->head, &head, new_head, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+   __atomic_fetch_add(&cache->batches, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Pops a batch of TRANSFER_BATCH linked blocks from the transfer cache of a
+ * class with one compare and swap of the head. The next_batch link of the
+ * head may be rewritten by a thread that popped it meanwhile, the tag then
+ * makes the compare and swap fail and the pop is retried.
+ * params: size class index.
+ * returns: first block of the batch, NULL if the cache is empty.
+ */
+free_block * transfer_pop(unsigned int size_class)
+{
+   transfer_cache *cache = &transfer_caches[size_class];
+   unsigned long new_head;
+   free_block *batch;
+
+   if(0 == __atomic_load_n(&cache->head, __ATOMIC_RELAXED))
+   {
+       return NULL;
+   }
+
+   // keeps malloc_trim() from unmapping a chunk under a stale batch.
+   __atomic_fetch_add(&transfer_poppers, 1, __ATOMIC_SEQ_CST);
+   unsigned long head = __atomic_load_n(&cache->head, __ATOMIC_SEQ_CST);
+   do
+   {
+       batch = (free_block *)(head & TRANSFER_PTR_MASK);
+       if(NULL == batch)
+       {
+           __atomic_fetch_sub(&transfer_poppers, 1, __ATOMIC_SEQ_CST);
+           return NULL;
+       }
+       free_block *next = __atomic_load_n(&batch->next_batch,
+                                          __ATOMIC_RELAXED);
+       new_head = ((head & ~TRANSFER_PTR_MASK) + TRANSFER_TAG_ONE) |
+                  ((unsigned long)next & TRANSFER_PTR_MASK);
+   }
+   while(!__atomic_compare_exchange_n(&cache->head, &head, new_head, 1,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+   __atomic_fetch_sub(&transfer_poppers, 1, __ATOMIC_SEQ_CST);
+   __atomic_fetch_sub(&cache->batches, 1, __ATOMIC_RELAXED);
+
+   batch->next_batch = NULL;
+   return batch;
+}
+
+
+/*
+ * Moves TRANSFER_BATCH blocks from the top of a bin to the transfer cache.
+ * The top holds the most recently freed blocks.
+ * params: heap of the calling thread, size class index (bin holds more
+ *         than TRANSFER_BATCH blocks).
+ */
+void flush_bin(thread_heap *heap, unsigned int size_class)
+{
+   free_block *batch = heap->small_bins[size_class];
+   free_block *last = batch;
+
+   for(unsigned int i = 1; i < TRANSFER_BATCH; i++)
+   {
+       last = last->next;
+   }
+
+   heap->small_bins[size_class] = last->next;
+   last->next = NULL;
+   transfer_push(size_class, batch);
+
+   heap->bin_count[size_class] -= TRANSFER_BATCH;
+   if(heap->bin_fresh[size_class] > heap->bin_count[size_class])
+   {
+       heap->bin_fresh[size_class] = heap->bin_count[size_class];
+   }
+   STATS_ADD(heap, total_free_blocks, -TRANSFER_BATCH);
+}
+
+
+/*
+ * Carves the next batch of never used blocks from the current slab of a
+ * class into its empty bin. The blocks are linked lowest address first, so
+ * they are handed out in address order like single carved blocks were.
+ * params: heap of the calling thread, size class index.
+ * returns: number of blocks added, 0 on failure.
+ */
+unsigned int refill_bin(thread_heap *heap, unsigned int size_class)
+{
+   unsigned int size = size_class_size[size_class];
+   unsigned int batch = heap->refill_batch[size_class];
+   slab_info *slab = heap->current_slab[size_class];
+
+   if(NULL == slab ||
+      slab->next_unused == size_class_num_blocks[size_class])
+   {
+       slab = new_slab(heap, size_class);
+       if(NULL == slab)
+       {
+           return 0;
+       }
+
+       /* another thread of the CPU may have put a slab in place while the
+          heap was unlocked, the new one goes back. */
+       if(NULL != heap->current_slab[size_class])
+       {
+           release_heap_pages(heap, slab, (void *)slab +
+                              size_class_pages[size_class] * SLAB_SIZE);
+           slab = heap->current_slab[size_class];
+       }
+       heap->current_slab[size_class] = slab;
+   }
+
+   // slow start: every refill of the class doubles the next one.
+   if(batch < REFILL_BATCH_MIN)
+   {
+       batch = REFILL_BATCH_MIN;
+   }
+   heap->refill_batch[size_class] =
+       (batch < REFILL_BATCH_MAX) ? 2 * batch : REFILL_BATCH_MAX;
+
+   unsigned int count = size_class_num_blocks[size_class] - slab->next_unused;
+   if(count > batch)
+   {
+       count = batch;
+   }
+
+   void *first = (void *)slab + size_class_first_block[size_class] +
+                 (unsigned long)slab->next_unused * size;
+   free_block *head = heap->small_bins[size_class];
+   for(unsigned int i = count; i-- > 0; )
+   {
+       free_block *block = first + (unsigned long)i * size;
+       block->next = head;
+       head = block;
+   }
+   heap->small_bins[size_class] = head;
+   slab->next_unused += count;
+   if(slab->next_unused == size_class_num_blocks[size_class])
+   {
+       heap->current_slab[size_class] = NULL;
+   }
+
+   /* fresh blocks must be the last ones of the bin. It is not empty at
+      thread exit, or when other threads of the CPU freed blocks to it while
+      the heap was unlocked, the new blocks count as used then. */
+   if(!slab->dirty && 0 == heap->bin_count[size_class])
+   {
+       heap->bin_fresh[size_class] += count;
+   }
+   heap->bin_count[size_class] += count;
+
+   // update stats variables.
+   STATS_ADD(heap, total_number_of_blocks, count);
+   STATS_ADD(heap, total_arena_size_allocated, (unsigned long)count * size);
+   STATS_ADD(heap, total_free_blocks, count);
+
+   return count;
+}
+
+
+/*
+ * Fills the bins of the PREPOPULATE_CLASSES smallest classes of a new heap,
+ * so the first allocations of a thread don't each take a slab.
+ * params: new heap of the calling thread.
+ */
+void prepopulate_bins(thread_heap *heap)
+{
+   for(unsigned int size_class = 0; size_class < PREPOPULATE_CLASSES;
+       size_class++)
+   {
+       if(NULL == heap->small_bins[size_class] &&
+          0 == refill_bin(heap, size_class))
+       {
+           return;
+       }
+   }
+}
+
+
+/*
+ * Allocate memory from heap area. For memory request of sizes <= 3584, blocks
+ * are allocated from slabs of the size class. Blocks always come from the
+ * bin of the class, a miss refills it with a batch of blocks.
+ * params : heap of the calling thread, size class index, set to the number of
+ *          leading bytes of the block that may not be zero.
+ * returns: pointer to allocated area.
+ */
+void *heap_allocate(thread_heap *heap, unsigned int size_class,
+                    size_t *dirty_size)
+{
+   free_block **bin = &heap->small_bins[size_class];
+
+   /* on a miss, first take back blocks freed by threads without a heap,
+    * then take a batch other threads left in the transfer cache, and only
+    * then carve a new batch. */
+   if(NULL == *bin)
+   {
+       if(__atomic_load_n(&heap->trim_pending, __ATOMIC_RELAXED))
+       {
+           trim_heap(heap);
+       }
+       reclaim_remote_free(heap);
+   }
+   if(NULL == *bin)
+   {
+       free_block *batch = transfer_pop(size_class);
+       if(NULL != batch)
+       {
+           *bin = batch;
+           heap->bin_count[size_class] = TRANSFER_BATCH;
+           STATS_ADD(heap, total_free_blocks, TRANSFER_BATCH);
+       }
+   }
+   if(NULL == *bin && 0 == refill_bin(heap, size_class))
+   {
+       return NULL;
+   }
+
+   free_block *p = *bin;
+   *bin = p->next;
+   p->next = NULL;
+
+   /* fresh blocks are at the bottom of the bin. slab pages come from never
+    * used heap memory and refill_bin() only wrote their next pointer, which
+    * was just cleared, so they are still zero. */
+   if(heap->bin_count[size_class]-- <= heap->bin_fresh[size_class])
+   {
+       heap->bin_fresh[size_class]--;
+       *dirty_size = 0;
+   }
+   else
+   {
+       *dirty_size = size_class_size[size_class];
+   }
+   STATS_ADD(heap, total_free_blocks, -1);
+
+   // mark block as in use.
+   slab_info *slab = slab_of(p);
+   unsigned int index = slab_block_index(slab, p);
+   __atomic_fetch_and(&slab->free_map[index / SLAB_MAP_BITS],
+                      ~(1UL << (index % SLAB_MAP_BITS)),
+                      __ATOMIC_RELAXED);
+
+   return p;
+}
+
+
+
+/*
+ * Maps a large block size to its bin in large_bins.
+ * params: size in bytes (> SMALL_SIZE_MAX), bin row and column to set.
+ */
+void large_bin_index(size_t size, unsigned int *fl, unsigned int *sl)
+{
+    *fl = LARGE_FL_COUNT - 1 - __builtin_clzl(size);
+    *sl = (size >> (*fl - LARGE_SL_BITS)) & (LARGE_SL_COUNT - 1);
+}
+
+
+/*
+ * Adds a free large block to the index. Blocks are pushed at the head of
+ * their bin.
+ * params: bins of the owner heap, block header.
+ */
+void large_bin_insert(large_bins *bins, block_info *block)
+{
+    unsigned int fl, sl;
+    large_bin_index(block->size, &fl, &sl);
+
+    block->next = bins->bins[fl][sl];
+    bins->bins[fl][sl] = block;
+    bins->sl_map[fl] |= 1 << sl;
+    bins->fl_map |= 1UL << fl;
+    bins->bytes += block->size;
+}
+
+
+/*
+  Finds best fitting block from large memory bin.
+  The request is first turned into the size of the block a miss would
+  create. Freed blocks of that size are in its own bin, which is searched
+  first, up to LARGE_BIN_SCAN blocks. Otherwise the size is rounded up to
+  the start of the next bin, so every block of the first non empty bin from
+  there on fits. That bin is found with a bit scan of sl_map in the row of
+  the request and then of fl_map for the rows above, and its head block is
+  taken. Both steps are constant time.
+*/
+void * find_best_fit_from_bin_large(thread_heap *heap, size_t size)
+{
+    large_bins *bins = &heap->bin_large;
+    unsigned int fl, sl;
+    unsigned long sl_candidates;
+
+    size = large_block_size(size);
+    if(0 == size)
+    {
+        return NULL;
+    }
+    large_bin_index(size, &fl, &sl);
+
+    block_info **link = &bins->bins[fl][sl];
+    for(unsigned int i = 0; i < LARGE_BIN_SCAN && NULL != *link; i++)
+    {
+        if((*link)->size >= size)
+        {
+            break;
+        }
+        link = &(*link)->next;
+    }
+
+    if(NULL == *link || (*link)->size < size)
+    {
+        size_t rounded = size + (1UL << (fl - LARGE_SL_BITS)) - 1;
+        if(rounded < size)
+        {
+            return NULL;
+        }
+        large_bin_index(rounded, &fl, &sl);
+
+        sl_candidates = bins->sl_map[fl] & (~0UL << sl);
+        if(0 == sl_candidates)
+        {
+            unsigned long fl_candidates = (fl + 1 < LARGE_FL_COUNT) ?
+                bins->fl_map & (~0UL << (fl + 1)) : 0;
+            if(0 == fl_candidates)
+            {
+                return NULL;
+            }
+            fl = __builtin_ctzl(fl_candidates);
+            sl_candidates = bins->sl_map[fl];
+        }
+        sl = __builtin_ctzl(sl_candidates);
+        link = &bins->bins[fl][sl];
+    }
+
+    block_info *best_fit = *link;
+    *link = best_fit->next;
+    if(NULL == bins->bins[fl][sl])
+    {
+        bins->sl_map[fl] &= ~(1 << sl);
+        if(0 == bins->sl_map[fl])
+        {
+            bins->fl_map &= ~(1UL << fl);
+        }
+    }
+    bins->bytes -= best_fit->size;
+
+    best_fit->next = NULL;
+    best_fit->state = BLOCK_IN_USE;
+    return (void *)best_fit + sizeof(block_info);
+}
+
+
+
+
+/*
+ * maps new memory address using mmap system call for size
+ * request > 3584 bytes.
+ * Requests kernel to map new memory at some place decided by kernel.
+ * params: requested size in bytes.
+ * returns: pointer to block allocated., NULL on failure (errno ENOMEM, also
+ *          when the size with header and page rounding overflows).
+ */
+void * mmap_new_memory(size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    // header and page rounding must not wrap around.
+    if(size > SIZE_MAX - sizeof(block_info) - page_size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t num_pages = ((size + sizeof(block_info) - 1) / page_size) + 1;
+    size_t required_page_size = page_size * num_pages;
+
+    void *ret = mmap(NULL, // let kernel decide.
+                     required_page_size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS| MAP_PRIVATE,
+                     -1, //no file descriptor
+                     0); //offset.
+    if(ret == MAP_FAILED)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    block_info b;
+    b.size = (required_page_size - sizeof(block_info));
+    b.state = BLOCK_IN_USE;
+    b.lead = 0;
+    b.next = NULL;
+
+    ret = memcpy(ret, &b, sizeof(block_info));
+    ret = ((char*)ret + sizeof(block_info));
+
+    return ret;
+}
+
+
+
+/*
+ * returns the bytes of the page run of a medium request, header included.
+ * Past MEDIUM_EXACT_PAGES the page count is rounded up to a multiple of a
+ * quarter of the power of two below it.
+ * params: requested size (SMALL_SIZE_MAX < size <= MEDIUM_SIZE_MAX).
+ */
+size_t medium_run_size(size_t size)
+{
+    size_t pages = (size + sizeof(block_info) + SLAB_SIZE - 1) / SLAB_SIZE;
+
+    if(pages > MEDIUM_EXACT_PAGES)
+    {
+        unsigned int shift = 8 * sizeof(long) - 1 -
+                             __builtin_clzl(pages - 1) - 2;
+        size_t step = 1UL << shift;
+        pages = (pages + step - 1) & ~(step - 1);
+    }
+    return pages * SLAB_SIZE;
+}
+
+
+/*
+ * returns the usable size of the block malloc creates for a request
+ * > SMALL_SIZE_MAX when nothing is reused: medium requests get a medium
+ * run, bigger ones whole pages, both minus the header.
+ * params: requested size (> SMALL_SIZE_MAX).
+ * returns: block size, 0 if the size can't be served.
+ */
+size_t large_block_size(size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    if(size <= MEDIUM_SIZE_MAX)
+    {
+        return medium_run_size(size) - sizeof(block_info);
+    }
+    if(size > SIZE_MAX - sizeof(block_info) - page_size)
+    {
+        return 0;
+    }
+    return ((sizeof(block_info) + size + page_size - 1) & ~(page_size - 1)) -
+           sizeof(block_info);
+}
+
+
+/*
+ * Carves a medium block from the thread heap. The pages come from never
+ * used heap memory or from free_slices, zero apart from the header unless
+ * the thread heap came from a run that was not RUN_CLEAN.
+ * params: heap of the calling thread, requested size (<= MEDIUM_SIZE_MAX),
+ *         set to the number of leading bytes of the block that may not be
+ *         zero.
+ * returns: pointer to the block, NULL on failure.
+ */
+void * alloc_medium(thread_heap *heap, size_t size, size_t *dirty_size)
+{
+    size_t run = medium_run_size(size);
+
+    unlock_heap(heap);
+    block_info *block = block_from_unused_heap(run);
+    relock_heap(heap);
+
+    if(NULL == block)
+    {
+        return NULL;
+    }
+
+    block->size = run - sizeof(block_info);
+    block->state = BLOCK_IN_USE;
+    block->lead = 0;
+    block->next = NULL;
+    block->owner = heap;
+    *dirty_size = thread_heap_dirty ? block->size : 0;
+
+    // update stats variables.
+    STATS_ADD(heap, total_number_of_blocks, 1);
+    STATS_ADD(heap, total_arena_size_allocated, run);
+
+    return (void *)block + sizeof(block_info);
+}
+
+
+/*
+ * Maps a large block whose address is aligned to alignment. More than
+ * needed is mapped, the header goes just before the first aligned address
+ * and the unused pages on both sides are unmapped again. The distance from
+ * the start of the mapping to the header is kept in lead.
+ * params: requested size in bytes, alignment (power of two > 16).
+ * returns: pointer to block allocated., NULL on failure.
+ */
+void * mmap_aligned_memory(size_t size, size_t alignment)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t size_pages = (size + page_size - 1) & ~(page_size - 1);
+    size_t length = size_pages + alignment;
+
+    if(size_pages < size || length < size_pages)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(base == MAP_FAILED)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    uintptr_t ret = ((uintptr_t)base + sizeof(block_info) + alignment - 1) &
+                    ~(alignment - 1);
+    uintptr_t start = (ret - sizeof(block_info)) & ~(page_size - 1);
+    uintptr_t end = (ret + size + page_size - 1) & ~(page_size - 1);
+
+    if(start > (uintptr_t)base)
+    {
+        munmap(base, start - (uintptr_t)base);
+    }
+    if(end < (uintptr_t)base + length)
+    {
+        munmap((void *)end, (uintptr_t)base + length - end);
+    }
+
+    block_info *block = (block_info *)(ret - sizeof(block_info));
+    block->size = end - ret;
+    block->state = BLOCK_IN_USE;
+    block->lead = ret - sizeof(block_info) - start;
+    block->next = NULL;
+
+    return (void *)ret;
+}
+
+
+/*
+ * Unmaps a large block. The mapping starts lead bytes before the block
+ * header and is lead + sizeof(block_info) + size bytes long.
+ * params: heap of the calling thread (for statistics, may be NULL),
+ *         block header.
+ */
+void release_large_block(thread_heap *heap, block_info *block)
+{
+    size_t length = block->lead + sizeof(block_info) + block->size;
+
+    // medium pages go back to the heap.
+    if(is_medium_block(block))
+    {
+        void *start = (void *)block - block->lead;
+        release_heap_pages(heap, start, start + length);
+
+        if(NULL != heap)
+        {
+            STATS_ADD(heap, total_number_of_blocks, -1);
+            STATS_ADD(heap, total_arena_size_allocated, -length);
+        }
+        else
+        {
+            __atomic_fetch_sub(&heapless_stats.total_number_of_blocks, 1,
+                               __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&heapless_stats.total_arena_size_allocated,
+                               length, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+
+#ifdef PER_CPU_HEAPS
+    // unmapped once the lock of the CPU heap is let go.
+    if(NULL != heap)
+    {
+        block->next = heap->deferred_unmaps;
+        heap->deferred_unmaps = block;
+    }
+    else
+#endif
+    {
+        munmap((void *)block - block->lead, length);
+    }
+    if(NULL != heap)
+    {
+        STATS_ADD(heap, total_mmap_size_released, length);
+    }
+    else
+    {
+        __atomic_fetch_add(&heapless_stats.total_mmap_size_released, length,
+                           __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+ * Puts a freed large block in bin_large of its owner heap, in the huge
+ * cache if it is at least large_unmap_threshold bytes, or gives it back to
+ * the system if the bin would hold more than large_cache_max bytes.
+ * Mapped blocks dropped their pages in retire_large_block() already.
+ * Must be called by the owning thread.
+ * params: owner heap, block header of the freed block.
+ */
+void cache_large_block(thread_heap *heap, block_info *block)
+{
+    if(block->size >= large_unmap_threshold)
+    {
+        cache_huge_block(heap, block);
+        return;
+    }
+
+    unsigned long now = now_ms();
+    if(now >= heap->bin_large.decay_at)
+    {
+        decay_large_bins(heap, now);
+    }
+    if(__atomic_load_n(&heap->trim_pending, __ATOMIC_RELAXED))
+    {
+        trim_heap(heap);
+    }
+    if(heap->bin_large.bytes + block->size > large_cache_max)
+    {
+        release_large_block(heap, block);
+        return;
+    }
+
+    *(unsigned long *)((void *)block + sizeof(block_info)) = now;
+    large_bin_insert(&heap->bin_large, block);
+}
+
+
+/*
+ * Gives back the blocks cached in bin_large for dirty_decay_ms or more, by
+ * their time in the first word after the header. Medium blocks go back to
+ * free_slices dirty, where they decay like every free run, so a heap that
+ * stopped using a size doesn't keep its pages. Mapped blocks are unmapped.
+ * The next pass is due dirty_decay_ms / 2 later.
+ * Must be called by the owning thread.
+ * params: owner heap, current time in ms.
+ */
+void decay_large_bins(thread_heap *heap, unsigned long now)
+{
+    large_bins *bins = &heap->bin_large;
+    unsigned long fl_map = bins->fl_map;
+
+    bins->decay_at = now + dirty_decay_ms / 2;
+    while(0 != fl_map)
+    {
+        unsigned int fl = __builtin_ctzl(fl_map);
+        fl_map &= fl_map - 1;
+
+        for(unsigned int sl = 0; sl < LARGE_SL_COUNT; sl++)
+        {
+            block_info **link = &bins->bins[fl][sl];
+            while(NULL != *link)
+            {
+                block_info *block = *link;
+                unsigned long cached_at =
+                    *(unsigned long *)((void *)block + sizeof(block_info));
+                if(now - cached_at < dirty_decay_ms)
+                {
+                    link = &block->next;
+                    continue;
+                }
+                *link = block->next;
+                bins->bytes -= block->size;
+                release_large_block(heap, block);
+            }
+            if(NULL == bins->bins[fl][sl])
+            {
+                bins->sl_map[fl] &= ~(1 << sl);
+            }
+        }
+        if(0 == bins->sl_map[fl])
+        {
+            bins->fl_map &= ~(1UL << fl);
+        }
+    }
+}
+
+
+/*
+ * returns the CLOCK_MONOTONIC time in milliseconds.
+ */
+unsigned long now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (unsigned long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/*
+ * returns the huge cache bucket of a block size.
+ * params: block size (> SMALL_SIZE_MAX).
+ */
+unsigned int huge_bucket(size_t size)
+{
+    unsigned int fl, sl;
+
+    large_bin_index(size, &fl, &sl);
+    return fl * LARGE_SL_COUNT + sl;
+}
+
+
+/*
+ * Removes an entry from its bucket and the age list. Called with
+ * global_heap_mutex held.
+ * params: entry.
+ */
+void huge_cache_unlink(huge_entry *entry)
+{
+    block_info *block = (block_info *)((void *)entry - sizeof(block_info));
+
+    if(NULL != entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    if(NULL != entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        huge_buckets[huge_bucket(block->size)] = entry->next;
+    }
+
+    if(NULL != entry->newer)
+    {
+        entry->newer->older = entry->older;
+    }
+    else
+    {
+        __atomic_store_n(&huge_newest, entry->older, __ATOMIC_RELAXED);
+    }
+    if(NULL != entry->older)
+    {
+        entry->older->newer = entry->newer;
+    }
+    else
+    {
+        huge_oldest = entry->newer;
+    }
+
+    huge_cache_bytes -= block->size;
+}
+
+
+/*
+ * Takes the entries out of the huge cache that were freed more than
+ * huge_cache_decay_ms ago, and the oldest ones while it holds more than
+ * huge_cache_max bytes. They are only unmapped by the caller, after it
+ * released global_heap_mutex. Called with global_heap_mutex held.
+ * params: current time in ms.
+ * returns: the entries taken out, linked through next.
+ */
+huge_entry * huge_cache_expire(unsigned long now)
+{
+    huge_entry *expired = NULL;
+
+    while(NULL != huge_oldest &&
+          (huge_cache_bytes > huge_cache_max ||
+           now - huge_oldest->freed_at > huge_cache_decay_ms))
+    {
+        huge_entry *entry = huge_oldest;
+        huge_cache_unlink(entry);
+        entry->next = expired;
+        expired = entry;
+    }
+    return expired;
+}
+
+
+/*
+ * Unmaps entries taken out of the huge cache.
+ * params: heap of the calling thread (for statistics, may be NULL),
+ *         entries linked through next.
+ */
+void release_huge_entries(thread_heap *heap, huge_entry *entry)
+{
+    while(NULL != entry)
+    {
+        huge_entry *next = entry->next;
+        release_large_block(heap,
+            (block_info *)((void *)entry - sizeof(block_info)));
+        entry = next;
+    }
+}
+
+
+/*
+ * Keeps a freed huge block in the huge cache as the most recently freed
+ * one, and expires old entries unless the purge thread does. Medium
+ * blocks, blocks of aligned mappings and blocks bigger than the whole
+ * cache are given back right away.
+ * Any thread can call it.
+ * params: heap of the calling thread (for statistics, may be NULL),
+ *         block header.
+ */
+void cache_huge_block(thread_heap *heap, block_info *block)
+{
+    if(0 == huge_cache_max || block->size > huge_cache_max ||
+       0 != block->lead || is_medium_block(block))
+    {
+        release_large_block(heap, block);
+        return;
+    }
+
+    huge_entry *entry = (huge_entry *)((void *)block + sizeof(block_info));
+    unsigned int bucket = huge_bucket(block->size);
+    unsigned long now = now_ms();
+
+    pthread_mutex_lock(&global_heap_mutex);
+    entry->freed_at = now;
+    entry->prev = NULL;
+    entry->next = huge_buckets[bucket];
+    if(NULL != entry->next)
+    {
+        entry->next->prev = entry;
+    }
+    huge_buckets[bucket] = entry;
+
+    entry->newer = NULL;
+    entry->older = huge_newest;
+    if(NULL != huge_newest)
+    {
+        huge_newest->newer = entry;
+    }
+    else
+    {
+        huge_oldest = entry;
+    }
+    __atomic_store_n(&huge_newest, entry, __ATOMIC_RELAXED);
+    huge_cache_bytes += block->size;
+
+    // the purge thread expires the cache when it runs.
+    huge_entry *expired = NULL;
+    if(!background_purge)
+    {
+        expired = huge_cache_expire(now);
+    }
+    else if(huge_cache_bytes > huge_cache_max)
+    {
+        pthread_cond_signal(&purge_wake);
+    }
+    pthread_mutex_unlock(&global_heap_mutex);
+
+    release_huge_entries(heap, expired);
+}
+
+
+/*
+ * Takes a block that fits size from the huge cache: one of the first
+ * LARGE_BIN_SCAN entries of the bucket of size that hold it, or else the
+ * most recently freed block of the first non empty bucket from size
+ * rounded up like in find_best_fit_from_bin_large(), where every block
+ * holds size bytes. The cache is only locked when it is not empty. Old
+ * entries are expired too, unless the purge thread does.
+ * params: heap of the calling thread, requested size.
+ * returns: pointer to the block, NULL if none fits.
+ */
+void * huge_cache_get(thread_heap *heap, size_t size)
+{
+    unsigned int fl, sl;
+
+    if(NULL == __atomic_load_n(&huge_newest, __ATOMIC_RELAXED))
+    {
+        return NULL;
+    }
+
+    large_bin_index(size, &fl, &sl);
+    size_t rounded = size + (1UL << (fl - LARGE_SL_BITS)) - 1;
+    if(rounded < size)
+    {
+        return NULL;
+    }
+    unsigned int first = huge_bucket(rounded);
+    unsigned int last = first + HUGE_CACHE_FIT_BUCKETS;
+    if(last > HUGE_CACHE_BUCKETS)
+    {
+        last = HUGE_CACHE_BUCKETS;
+    }
+
+    pthread_mutex_lock(&global_heap_mutex);
+    huge_entry *entry = huge_buckets[huge_bucket(size)];
+    for(unsigned int i = 0; i < LARGE_BIN_SCAN && NULL != entry; i++)
+    {
+        block_info *block = (block_info *)((void *)entry - sizeof(block_info));
+        if(block->size >= size)
+        {
+            break;
+        }
+        entry = entry->next;
+    }
+    if(NULL != entry &&
+       ((block_info *)((void *)entry - sizeof(block_info)))->size < size)
+    {
+        entry = NULL;
+    }
+    for(unsigned int bucket = first; bucket < last && NULL == entry;
+        bucket++)
+    {
+        entry = huge_buckets[bucket];
+    }
+    if(NULL != entry)
+    {
+        huge_cache_unlink(entry);
+    }
+    huge_entry *expired = background_purge ? NULL :
+                          huge_cache_expire(now_ms());
+    pthread_mutex_unlock(&global_heap_mutex);
+
+    // called without the lock of a CPU heap, so not counted in its stats.
+    release_huge_entries(NULL, expired);
+    if(NULL == entry)
+    {
+        return NULL;
+    }
+
+    block_info *block = (block_info *)((void *)entry - sizeof(block_info));
+    block->state = BLOCK_IN_USE;
+    block->next = NULL;
+    block->owner = heap;
+    return entry;
+}
+
+
+/*
+ * Reads a size tunable from the environment.
+ * params: variable name, value used when it is unset or invalid.
+ * returns: value of the tunable.
+ */
+size_t read_tunable(const char *name, size_t default_value)
+{
+    const char *value = getenv(name);
+    char *end = NULL;
+
+    if(NULL == value || '\0' == *value)
+    {
+        return default_value;
+    }
+
+    errno = 0;
+    unsigned long result = strtoul(value, &end, 0);
+    if(0 != errno || '\0' != *end)
+    {
+        return default_value;
+    }
+    return result;
+}
+
+
+
+
+/*
+ * Reads the free fill policy from MALLOC_FREE_FILL.
+ * params: NONE.
+ * returns: FREE_FILL_NONE, FREE_FILL_ZERO or FREE_FILL_JUNK.
+ */
+int read_free_fill(void)
+{
+    const char *value = getenv("MALLOC_FREE_FILL");
+
+    if(NULL == value)
+    {
+        return FREE_FILL_NONE;
+    }
+    if(0 == strcmp(value, "zero"))
+    {
+        return FREE_FILL_ZERO;
+    }
+    if(0 == strcmp(value, "junk"))
+    {
+        return FREE_FILL_JUNK;
+    }
+    return FREE_FILL_NONE;
+}
+
+
+
+
+/*
+ * Writes the free fill pattern over a block being freed.
+ * params: block address, number of bytes to fill.
+ * returns: NONE.
+ */
+void fill_freed_block(void *p, size_t size)
+{
+    if(FREE_FILL_ZERO == free_fill)
+    {
+        memset(p, '\0', size);
+    }
+    else if(FREE_FILL_JUNK == free_fill)
+    {
+        memset(p, FREE_JUNK_BYTE, size);
+    }
+}
+
+
+/*
+ * Performs allocation for request > 3584 bytes.
+ * params : heap of the calling thread, requested memory size.
+ * returns: pointer to allocated memory. NULL on failure.
+ */
+void *alloc_large(thread_heap *heap, size_t size, size_t *dirty_size)
+{
+   void * ret = NULL;
+   if(0 != heap->bin_large.fl_map)
+   {
+       ret = find_best_fit_from_bin_large(heap, size);
+   }
+
+   /* take back large blocks other threads have freed and retry. */
+   if(ret == NULL && reclaim_remote_free(heap) > 0 &&
+      0 != heap->bin_large.fl_map)
+   {
+       ret = find_best_fit_from_bin_large(heap, size);
+   }
+
+   /* cached mapped blocks had every page but the header page dropped, so
+    * only the rest of that first page can hold old data, and the first
+    * word, which held the time the block was cached. With background
+    * purging they keep their pages. */
+   if(ret != NULL)
+   {
+       block_info *block = (block_info *)(ret - sizeof(block_info));
+       if(is_medium_block(block) || background_purge)
+       {
+           *dirty_size = block->size;
+       }
+       else
+       {
+           *dirty_size =
+               sysconf(_SC_PAGESIZE) - block->lead - sizeof(block_info);
+           if(*dirty_size < sizeof(unsigned long))
+           {
+               *dirty_size = sizeof(unsigned long);
+           }
+       }
+   }
+
+   /* either bin_large is empty or no best fit was found. Medium requests
+    * are carved from the heap, only bigger ones are mapped. */
+   if(ret == NULL && size <= MEDIUM_SIZE_MAX)
+   {
+       ret = alloc_medium(heap, size, dirty_size);
+   }
+   /* huge blocks other threads freed come back with their pages. Neither
+    * that nor mapping new memory needs the heap, the lock of a CPU heap is
+    * let go meanwhile. */
+   if(ret == NULL && size > MEDIUM_SIZE_MAX)
+   {
+       int mapped = 0;
+
+       unlock_heap(heap);
+       ret = huge_cache_get(heap, size);
+       if(NULL != ret)
+       {
+           *dirty_size = ((block_info *)(ret - sizeof(block_info)))->size;
+       }
+       else
+       {
+           ret = mmap_new_memory(size);
+           if(NULL != ret)
+           {
+               ((block_info *)(ret - sizeof(block_info)))->owner = heap;
+               *dirty_size = 0;
+               mapped = 1;
+           }
+       }
+       relock_heap(heap);
+
+       if(mapped)
+       {
+           STATS_ADD(heap, total_mmap_size_allocated, size);
+       }
+   }
+    return ret;
+}
+
+
+/*
+ * Allocates the memory.
+ */
+void *allocate(size_t size, size_t *dirty_size)
+{
+     void * ret = NULL;
+
+     thread_heap *heap = lock_heap(1);
+     if(NULL == heap)
+     {
+        return NULL;
+     }
+
+     STATS_ADD(heap, total_allocation_request, 1);
+
+     // allocate from either large bin or mmap.
+     if(size > SMALL_SIZE_MAX)
+     {
+        ret = alloc_large(heap, size, dirty_size);
+     }
+     else
+     {
+       ret = heap_allocate(heap, size_to_class(size), dirty_size);
+     }
+     unlock_heap(heap);
+     return ret;
+}
+
+
+
+
+void* malloc(size_t size)
+{
+     size_t dirty_size;
+
+     return allocate(size, &dirty_size);
+}
+
+
+
+/*
+ * Frees a block whose kind is already known.
+ * params: address to pointer to be freed, non zero if it is a slab block.
+ * returns: NONE.
+ */
+void release_block(void *p, int small)
+{
+   /* large blocks are retired, and huge ones cached, before the heap is
+      locked: none of it needs the heap, and the syscalls and
+      global_heap_mutex are not taken under the lock of a CPU heap. */
+   if(NULL != p && !small)
+   {
+      block_info *block = (block_info *)(p - sizeof(block_info));
+      if(!retire_large_block(block))
+      {
+         return;
+      }
+
+      // too big for bin_large, shared by all threads.
+      if(block->size >= large_unmap_threshold)
+      {
+         __atomic_fetch_add(&heapless_stats.total_free_request, 1,
+                            __ATOMIC_RELAXED);
+         __atomic_fetch_add(&heapless_stats.total_free_blocks, 1,
+                            __ATOMIC_RELAXED);
+         cache_huge_block(NULL, block);
+         return;
+      }
+   }
+
+   /* free() never creates a thread heap: an exiting thread frees memory
+      after its heap has been abandoned. */
+   thread_heap *heap = lock_heap(0);
+
+   heap_free(heap, p, small);
+   unlock_heap(heap);
+}
+
+
+/*
+ * Marks a large block free and fills it. Pages of a mapped block that goes
+ * to bin_large, past the one holding the header, are released with
+ * MADV_DONTNEED, so cached blocks don't count against RSS (MADV_FREE pages
+ * stay in RSS until the kernel is short of memory). The kernel maps zero
+ * pages back on the next touch. Medium blocks are small and reused soon,
+ * they keep their pages, and so do all blocks when the purge thread runs.
+ * Needs no heap, the block is not reachable by other threads yet.
+ * params: block header.
+ * returns: 0 if the block was already free, 1 otherwise.
+ */
+int retire_large_block(block_info *block)
+{
+   // already freed?
+   if(block->state != BLOCK_IN_USE)
+   {
+      return 0;
+   }
+   block->state = BLOCK_FREE;
+
+   long page_size = sysconf(_SC_PAGESIZE);
+   int drop = (!is_medium_block(block) &&
+               block->size < large_unmap_threshold && !background_purge);
+
+   if(FREE_FILL_NONE != free_fill)
+   {
+      size_t fill = block->size;
+      if(drop)
+      {
+         fill = page_size - block->lead - sizeof(block_info);
+      }
+      fill_freed_block((void *)block + sizeof(block_info),
+                       block->size < fill ? block->size : fill);
+   }
+
+   void *start = (void *)block - block->lead + page_size;
+   void *end = (void *)block + sizeof(block_info) + block->size;
+   if(drop && start < end)
+   {
+      madvise(start, end - start, MADV_DONTNEED);
+   }
+   return 1;
+}
+
+
+/*
+ * Frees a block into a heap. Small blocks go to the bin of the heap, large
+ * blocks, retired and smaller than large_unmap_threshold (see
+ * release_block()), to the heap if it owns them, otherwise they are queued
+ * on remote_free of their owner heap. Blocks freed by a thread without a
+ * heap are remote frees.
+ * params: heap of the calling thread (may be NULL), address to pointer to
+ *         be freed, non zero if it is a slab block.
+ * returns: NONE.
+ */
+void heap_free(thread_heap *heap, void *p, int small)
+{
+   //update stats variables.
+   if(NULL != heap)
+   {
+      STATS_ADD(heap, total_free_request, 1);
+      STATS_ADD(heap, total_free_blocks, 1);
+   }
+   else
+   {
+      __atomic_fetch_add(&heapless_stats.total_free_request, 1,
+                         __ATOMIC_RELAXED);
+      __atomic_fetch_add(&heapless_stats.total_free_blocks, 1,
+                         __ATOMIC_RELAXED);
+   }
+
+   if(NULL != p && small)
+   {
+      slab_info *slab = slab_of(p);
+      unsigned int size_class = slab->size_class;
+      free_block *block = p;
+
+      // already freed? the free bit of the block is set.
+      unsigned int index = slab_block_index(slab, p);
+      unsigned long bit = 1UL << (index % SLAB_MAP_BITS);
+      unsigned long map = __atomic_fetch_or(
+                              &slab->free_map[index / SLAB_MAP_BITS], bit,
+                              __ATOMIC_RELAXED);
+      if(map & bit)
+      {
+         return;
+      }
+
+      if(FREE_FILL_NONE != free_fill)
+      {
+         fill_freed_block(p, size_class_size[size_class]);
+      }
+
+      /* small blocks go to the bin of the freeing thread whoever
+         allocated them, full bins spill into the transfer cache. Only a
+         thread without a heap hands them back to the owner. */
+      if(NULL == heap)
+      {
+         push_remote_free(slab->owner, p);
+         return;
+      }
+
+      // attach as head to free list of corresponding bin.
+      free_block **bin = &heap->small_bins[size_class];
+      block->next = *bin;
+      *bin = block;
+      if(++heap->bin_count[size_class] > BIN_HIGH_WATER)
+      {
+         flush_bin(heap, size_class);
+      }
+      else if((map | bit) == ~0UL)
+      {
+         // this free may have been the last one of the slab.
+         release_empty_slab(heap, slab);
+      }
+   }
+   else if(NULL != p)
+   {
+      block_info *block  = (block_info *)(p - sizeof(block_info));
+
+      if(block->owner != heap)
+      {
+         push_remote_free(block->owner, p);
+         return;
+      }
+
+      cache_large_block(heap, block);
+    }
+}
+
+
+
+
+/*
+ * Free up the memory allocated at pointer p. The kind of block is looked up
+ * in the chunk map.
+ * params: address to pointer to be freed.
+ * returns: NONE.
+ */
+void free(void *p)
+{
+   release_block(p, NULL != p && is_small_block(p));
+}
+
+
+
+
+/*
+ * Frees a block whose requested size is known (C23). Requests up to
+ * SMALL_SIZE_MAX always get slab blocks, so the chunk map is not read.
+ * params: pointer returned by malloc, calloc or realloc, requested size.
+ * returns: NONE.
+ */
+void free_sized(void *p, size_t size)
+{
+   release_block(p, size <= SMALL_SIZE_MAX);
+}
+
+
+
+
+/*
+ * Frees a block from aligned_alloc whose alignment and size are known (C23).
+ * It is a slab block if a size class is aligned enough, as in
+ * aligned_allocate().
+ * params: pointer returned by aligned_alloc, its alignment and size.
+ * returns: NONE.
+ */
+void free_aligned_sized(void *p, size_t alignment, size_t size)
+{
+   release_block(p, size <= SMALL_SIZE_MAX &&
+                    aligned_size_class(size, alignment) < NUM_SIZE_CLASSES);
+}
+
+
+
+
+/*
+ * Returns the number of usable bytes in the block at p, which may be more
+ * than was requested.
+ * params: pointer returned by malloc (may be NULL).
+ * returns: usable size in bytes, 0 for NULL.
+ */
+size_t malloc_usable_size(void *p)
+{
+   if(NULL == p)
+   {
+      return 0;
+   }
+   return block_size(p);
+}
+
+
+
+
+/*
+ * Returns the usable size malloc or aligned_allocate would give for a
+ * request without allocating anything. Blocks reused from bin_large may
+ * turn out bigger.
+ * params: requested size, MALLOCX_LG_ALIGN() flags or 0.
+ * returns: rounded size in bytes, 0 if the request can't be served.
+ */
+size_t nallocx(size_t size, int flags)
+{
+   size_t page_size = sysconf(_SC_PAGESIZE);
+   size_t alignment = 0;
+
+   if(0 != (flags & MALLOCX_LG_ALIGN_MASK))
+   {
+      alignment = 1UL << (flags & MALLOCX_LG_ALIGN_MASK);
+   }
+
+   if(alignment <= 16 ||
+      (alignment <= sizeof(block_info) && size > SMALL_SIZE_MAX))
+   {
+      alignment = 0;
+   }
+   else if(0 == size)
+   {
+      // like aligned_allocate().
+      size = 1;
+   }
+
+   unsigned int size_class = NUM_SIZE_CLASSES;
+   if(size <= SMALL_SIZE_MAX)
+   {
+      size_class = 0 == alignment ?
+          size_to_class(size) : aligned_size_class(size, alignment);
+   }
+   if(size_class < NUM_SIZE_CLASSES)
+   {
+      return size_class_size[size_class];
+   }
+
+   if(0 == alignment)
+   {
+      return large_block_size(size);
+   }
+   if(alignment <= SLAB_SIZE &&
+      size <= MEDIUM_SIZE_MAX - (alignment - sizeof(block_info)))
+   {
+      return medium_run_size(size + alignment - sizeof(block_info)) -
+             alignment;
+   }
+
+   /* large blocks fill their pages. aligned mappings put the header just
+      before the aligned address, which is a page start when alignment is
+      at least a page. */
+   size_t head = alignment < page_size ? alignment : 0;
+   if(size > SIZE_MAX - head - page_size)
+   {
+      return 0;
+   }
+   return ((head + size + page_size - 1) & ~(page_size - 1)) - head;
+}
+
+
+/*similar to calloc of glibc */
+void *calloc(size_t nmemb, size_t size)
+{
+     size_t total;
+     size_t dirty_size = 0;
+
+     if(__builtin_mul_overflow(nmemb, size, &total))
+     {
+        errno = ENOMEM;
+        return NULL;
+     }
+
+     void *p = allocate(total, &dirty_size);
+     if(NULL != p && dirty_size > 0)
+     {
+        memset(p, '\0', dirty_size < total ? dirty_size : total);
+     }
+     return p;
+}
+
+
+
+
+/*
+ * Resizes a large block with mremap(MREMAP_MAYMOVE). The kernel shrinks or
+ * grows the mapping in place when it can, and otherwise moves its page
+ * tables to a new address, so the payload is never copied byte by byte.
+ * Medium blocks are part of a chunk mapping and are never remapped.
+ * params: pointer to a large block, new size (> SMALL_SIZE_MAX).
+ * returns: pointer to the resized block, NULL on failure or for a medium
+ *          block (ptr is kept). A size whose mapping length overflows fails
+ *          with ENOMEM.
+ */
+void * resize_large_block(void *ptr, size_t size)
+{
+    block_info *block = (block_info *)(ptr - sizeof(block_info));
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    if(is_medium_block(block))
+    {
+        return NULL;
+    }
+    size_t lead = block->lead;
+    if(size > SIZE_MAX - lead - sizeof(block_info) - page_size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t old_length = lead + sizeof(block_info) + block->size;
+    size_t new_length = ((lead + sizeof(block_info) + size + page_size - 1) /
+                         page_size) * page_size;
+
+    if(new_length == old_length)
+    {
+        return ptr;
+    }
+    void *mapping = mremap((void *)block - lead, old_length, new_length,
+                           MREMAP_MAYMOVE);
+    if(mapping == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    block = (block_info *)(mapping + lead);
+    block->size = new_length - lead - sizeof(block_info);
+
+    thread_heap *heap = lock_heap(0);
+    if(NULL != heap)
+    {
+        if(new_length > old_length)
+        {
+            STATS_ADD(heap, total_mmap_size_allocated,
+                      new_length - old_length);
+        }
+        else
+        {
+            STATS_ADD(heap, total_mmap_size_released,
+                      old_length - new_length);
+        }
+    }
+    unlock_heap(heap);
+    return (void *)block + sizeof(block_info);
+}
+
+
+/*
+ * reallocates the pointer with new size size and copies the old data to new
+ * location.
+ * The block is kept when the new size still fits in it and would not leave
+ * more than half of it unused (small blocks up to 64 bytes are always
+ * kept). Large blocks are resized with mremap, which moves page tables
+ * instead of copying. Small blocks sit in fixed size slab slots, there is
+ * no free space next to them to grow into, so they are moved.
+ * params: pointer to reallocate. and new size.
+ * returns: pointer to new allocated memory chunk.
+ */
+void *realloc(void *ptr, size_t size)
+{
+    if(NULL == ptr)
+    {
+       return malloc(size);
+    }
+
+    size_t old_size = block_size(ptr);
+    int small = is_small_block(ptr);
+
+    /* a large block is not kept for a small size, so blocks of requests up
+       to SMALL_SIZE_MAX stay slab blocks for free_sized. */
+    if(size <= old_size && (size >= old_size / 2 || old_size <= 64) &&
+       (small || size > SMALL_SIZE_MAX))
+    {
+        return ptr;
+    }
+
+    if(!small && size > SMALL_SIZE_MAX)
+    {
+        void *resized = resize_large_block(ptr, size);
+        if(NULL != resized)
+        {
+            return resized;
+        }
+    }
+
+    void *newptr = malloc(size);
+
+    if(NULL == newptr)
+    {
+        return NULL;
+    }
+    /* copy no more than the new block holds, blocks are packed back to
+       back in slabs. */
+    size_t copy_size = old_size;
+    if(copy_size > size)
+    {
+        copy_size = size;
+    }
+    memcpy(newptr, ptr, copy_size);
+
+    free(ptr);
+
+    return newptr;
+}
+
+
+/*
+ * Fork hook. This will be called before fork happens.
+ * The method holds lock so as to make sure none of the active threads
+ * are holding lock and thus making sure, none of the threads are
+ * in middle of malloc process.
+ * later child hooks can reset the mutex to initial value.
+ */
+void prep_fork(void)
+{
+    // take lock before fork so as to make sure no other thread is
+    // holding lock.
+#ifdef PER_CPU_HEAPS
+    // heap locks are taken before global_heap_mutex in malloc too.
+    for(unsigned int cpu = 0; cpu < MAX_CPU_HEAPS; cpu++)
+    {
+        if(NULL != cpu_heaps[cpu])
+        {
+            heap_lock(cpu_heaps[cpu]);
+        }
+    }
+#endif
+    pthread_mutex_lock(&global_heap_mutex);
+}
+
+
+/*
+ * Releases the locks prep_fork took in the parent process. The mutex is
+ * unlocked, not reset: other threads may sleep on it, and a reset would
+ * lose their wakeup.
+ */
+void parent_fork_handle(void)
+{
+  pthread_mutex_unlock(&global_heap_mutex);
+#ifdef PER_CPU_HEAPS
+  for(unsigned int cpu = 0; cpu < MAX_CPU_HEAPS; cpu++)
+  {
+      unlock_heap(cpu_heaps[cpu]);
+  }
+#endif
+}
+
+
+/*
+ * Since mutex is held by prep_fork method, it can safely be reset
+ * in child process. The child only has the forking thread, nobody else
+ * waits on the mutex or on purge_wake.
+ */
+void child_fork_handle(void)
+{
+   pthread_mutex_init(&global_heap_mutex, NULL);
+   // the purging thread is not copied, free() purges in the child.
+   background_purge = 0;
+   pthread_cond_init(&purge_wake, NULL);
+#ifdef PER_CPU_HEAPS
+   for(unsigned int cpu = 0; cpu < MAX_CPU_HEAPS; cpu++)
+   {
+       unlock_heap(cpu_heaps[cpu]);
+   }
+#endif
+}
+
+
+
+/*
+ * Global constructor to Initialize the fork hooks
+ */
+__attribute__((constructor)) void sharedLibConstructor(void)
+{
+  int ret =
+      pthread_atfork(&prep_fork,
+                     &parent_fork_handle,
+                     &child_fork_handle);
+  if (ret != 0)
+  {
+      perror("pthread_atfork() error [Call #1]. Malloc is now not fork safe.");
+  }
+
+  large_unmap_threshold =
+      read_tunable("MALLOC_LARGE_UNMAP_THRESHOLD", large_unmap_threshold);
+  large_cache_max = read_tunable("MALLOC_LARGE_CACHE_MAX", large_cache_max);
+  huge_cache_max = read_tunable("MALLOC_HUGE_CACHE_MAX", huge_cache_max);
+  huge_cache_decay_ms =
+      read_tunable("MALLOC_HUGE_CACHE_DECAY_MS", huge_cache_decay_ms);
+  dirty_decay_ms = read_tunable("MALLOC_DIRTY_DECAY_MS", dirty_decay_ms);
+  muzzy_decay_ms = read_tunable("MALLOC_MUZZY_DECAY_MS", muzzy_decay_ms);
+  dirty_max = read_tunable("MALLOC_DIRTY_MAX", dirty_max);
+  dirty_purge_at = dirty_max;
+  transparent_hugepages = (0 != read_tunable("MALLOC_HUGEPAGES", 0));
+
+  if(0 != read_tunable("MALLOC_BACKGROUND_PURGE", 0))
+  {
+      pthread_t purger;
+      background_purge = 1;
+      if(pthread_create(&purger, NULL, &purge_thread, NULL) != 0)
+      {
+          perror("pthread_create() error. Free pages are purged by free().");
+          background_purge = 0;
+      }
+      else
+      {
+          pthread_detach(purger);
+      }
+  }
+  free_fill = read_free_fill();
+
+  /*if(mcheck(NULL) != 0)
+  {  TODO: mcheck implemtation.
+      perror("\n mcheck failed");
+  }*/
+
+}
+
+
+/*
+ * Serves an aligned request from a medium run. The run is taken like one
+ * for size + alignment - sizeof(block_info) bytes, from bin_large or the
+ * thread heap, and the header is moved forward so the block starts at the
+ * first aligned address past the start of the run, which is a page start
+ * (the start of the mapping, if bin_large gave back a mapped block).
+ * The distance from the run start to the header is kept in lead.
+ * params: heap of the calling thread, requested size, alignment (power of
+ *         two, sizeof(block_info) < alignment <= SLAB_SIZE).
+ * returns: pointer to the block, NULL on failure.
+ */
+void * alloc_medium_aligned(thread_heap *heap, size_t size, size_t alignment)
+{
+    size_t lead = alignment - sizeof(block_info);
+    size_t dirty_size;
+    void *p = alloc_large(heap, size + lead, &dirty_size);
+
+    if(NULL == p)
+    {
+        return NULL;
+    }
+
+    // the run may have held an aligned block before.
+    block_info *old = p - sizeof(block_info);
+    void *start = (void *)old - old->lead;
+    void *end = p + old->size;
+
+    block_info *block = start + lead;
+    block->size = end - (void *)block - sizeof(block_info);
+    block->state = BLOCK_IN_USE;
+    block->lead = lead;
+    block->next = NULL;
+    block->owner = heap;
+
+    // bin_large may also hand back a mapped block, which needs no mark.
+    void *ret = (void *)block + sizeof(block_info);
+    if(is_medium_block(block))
+    {
+        chunk_info *chunk = chunk_of(ret);
+        chunk->slab_page[(ret - (void *)chunk) / SLAB_SIZE] =
+            SLAB_PAGE_ALIGNED;
+    }
+    return ret;
+}
+
+
+/*
+ * Allocates size bytes aligned to alignment. Alignments up to 16 bytes are
+ * met by every block. Small requests take the smallest size class whose
+ * blocks are naturally aligned enough. Large blocks are aligned to 32 bytes
+ * (page start + header), bigger alignments up to a page are served from
+ * medium runs, yet bigger ones or sizes get their own aligned mapping.
+ * params: alignment (power of two), requested size.
+ * returns: pointer to allocated memory. NULL on failure.
+ */
+void *aligned_allocate(size_t alignment, size_t size)
+{
+    size_t dirty_size;
+
+    if(alignment <= 16 ||
+       (alignment <= sizeof(block_info) && size > SMALL_SIZE_MAX))
+    {
+        return malloc(size);
+    }
+
+    /* a block of size 0 would end where its run ends, the header of the
+       next block. */
+    if(0 == size)
+    {
+        size = 1;
+    }
+
+    thread_heap *heap = lock_heap(1);
+    if(NULL == heap)
+    {
+        return NULL;
+    }
+
+    STATS_ADD(heap, total_allocation_request, 1);
+
+    void *ret = NULL;
+    unsigned int size_class = NUM_SIZE_CLASSES;
+    if(size <= SMALL_SIZE_MAX)
+    {
+        size_class = aligned_size_class(size, alignment);
+    }
+
+    if(size_class < NUM_SIZE_CLASSES)
+    {
+        ret = heap_allocate(heap, size_class, &dirty_size);
+    }
+    else if(alignment <= SLAB_SIZE &&
+            size <= MEDIUM_SIZE_MAX - (alignment - sizeof(block_info)))
+    {
+        ret = alloc_medium_aligned(heap, size, alignment);
+    }
+    else
+    {
+        unlock_heap(heap);
+        ret = mmap_aligned_memory(size, alignment);
+        relock_heap(heap);
+        if(NULL != ret)
+        {
+            ((block_info *)(ret - sizeof(block_info)))->owner = heap;
+            STATS_ADD(heap, total_mmap_size_allocated, size);
+        }
+    }
+    unlock_heap(heap);
+    return ret;
+}
+
+
+/*
+ * aligns memory. alignment must be a power of two.
+ */
+void *memalign(size_t alignment, size_t s)
+{
+    if(0 == alignment || 0 != (alignment & (alignment - 1)))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return aligned_allocate(alignment, s);
+}
+
+
+/*
+ * POSIX aligned allocation. alignment must be a power of two multiple of
+ * sizeof(void *). errno is left untouched, the error is returned instead.
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if(alignment < sizeof(void *) || 0 != (alignment & (alignment - 1)))
+    {
+        return EINVAL;
+    }
+
+    int saved_errno = errno;
+    void *p = aligned_allocate(alignment, size);
+    errno = saved_errno;
+    if(NULL == p)
+    {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
+
+/*
+ * C11 aligned allocation.
+ */
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+
+/*
+ * Allocates page aligned memory.
+ */
+void *valloc(size_t size)
+{
+    return aligned_allocate(sysconf(_SC_PAGESIZE), size);
+}
+
+
+/*
+ * Allocates page aligned memory, size is rounded up to whole pages.
+ */
+void *pvalloc(size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t rounded = (size + page_size - 1) & ~(page_size - 1);
+
+    if(rounded < size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return aligned_allocate(page_size, rounded);
+}
+
+
+/*
+ * Gives the pages of medium blocks cached in bin_large of a heap back to the
+ * kernel, but the one holding block_info. Mapped blocks had theirs dropped
+ * when they were cached, and medium blocks are cleared in full when reused.
+ * params: heap of the calling thread.
+ * returns: 1 if pages were released, 0 otherwise.
+ */
+int trim_large_bins(thread_heap *heap)
+{
+    int released = 0;
+    unsigned int fl, sl;
+
+    for(fl = 0; fl < LARGE_FL_COUNT; fl++)
+    {
+        for(sl = 0; sl < LARGE_SL_COUNT; sl++)
+        {
+            for(block_info *block = heap->bin_large.bins[fl][sl];
+                NULL != block; block = block->next)
+            {
+                // pages after the one holding the header.
+                void *start = (void *)(((unsigned long)block +
+                                        sizeof(block_info) + SLAB_SIZE - 1) &
+                                       ~(unsigned long)(SLAB_SIZE - 1));
+                void *end = (void *)block + sizeof(block_info) + block->size;
+                if(start < end && is_medium_block(block))
+                {
+                    decommit_pages(start, end - start);
+                    released = 1;
+                }
+            }
+        }
+    }
+    return released;
+}
+
+
+/*
+ * Sweeps every small class of a heap and decommits the medium blocks in
+ * its bin_large. The transfer caches are emptied into the bins of the
+ * first heap trimmed, the blocks that don't free a slab go back to them.
+ * params: heap owned by the calling thread, locked or taken off
+ *         abandoned_heaps.
+ * returns: 1 if memory was released, 0 otherwise.
+ */
+int trim_heap(thread_heap *heap)
+{
+    int released = 0;
+
+    __atomic_store_n(&heap->trim_pending, 0, __ATOMIC_RELAXED);
+    reclaim_remote_free(heap);
+    for(unsigned int c = 0; c < NUM_SIZE_CLASSES; c++)
+    {
+        if(heap->bin_count[c] > 0 ||
+           0 != __atomic_load_n(&transfer_caches[c].head, __ATOMIC_RELAXED))
+        {
+            heap->sweep_credit[c] = 0;
+            released |= (sweep_small_class(heap, c, 0) > 0);
+        }
+    }
+    released |= trim_large_bins(heap);
+    return released;
+}
+
+
+/*
+ * Releases free memory to the system, like glibc malloc_trim(). There is
+ * no program break, the heap is made of chunks:
+ * 1) the heaps are trimmed (trim_heap()): the calling thread's, every CPU
+ *    heap under its lock, and the abandoned heaps, taken off the list
+ *    meanwhile. Heaps of other threads are only touched by their owner,
+ *    they are flagged to trim themselves on their next small bin miss or
+ *    large free.
+ * 2) a chunk that is one free run is unmapped, unless it is still carved
+ *    from or a thread carving or popping a transfer cache may touch it
+ *    (chunk_carvers, transfer_poppers).
+ * 3) free runs that are not RUN_CLEAN are decommitted. The first pad bytes
+ *    of free_slices, the most recently freed runs, are left as they are.
+ * 4) the huge cache is emptied.
+ * params: bytes of free runs to keep, most recently freed first.
+ * returns: 1 if memory was released, 0 otherwise.
+ */
+int malloc_trim(size_t pad)
+{
+    int released = 0;
+    size_t kept = 0;
+    thread_heap *heap;
+
+#ifdef PER_CPU_HEAPS
+    for(heap = __atomic_load_n(&all_heaps, __ATOMIC_ACQUIRE); NULL != heap;
+        heap = heap->next_heap)
+    {
+        heap_lock(heap);
+        released |= trim_heap(heap);
+        unlock_heap(heap);
+    }
+#else
+    for(heap = __atomic_load_n(&all_heaps, __ATOMIC_ACQUIRE); NULL != heap;
+        heap = heap->next_heap)
+    {
+        if(heap != current_heap)
+        {
+            __atomic_store_n(&heap->trim_pending, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if(NULL != current_heap)
+    {
+        released |= trim_heap(current_heap);
+    }
+
+    pthread_mutex_lock(&global_heap_mutex);
+    thread_heap *abandoned = abandoned_heaps;
+    abandoned_heaps = NULL;
+    pthread_mutex_unlock(&global_heap_mutex);
+
+    thread_heap *last = NULL;
+    for(heap = abandoned; NULL != heap; heap = heap->abandoned_next)
+    {
+        released |= trim_heap(heap);
+        last = heap;
+    }
+    if(NULL != last)
+    {
+        pthread_mutex_lock(&global_heap_mutex);
+        last->abandoned_next = abandoned_heaps;
+        abandoned_heaps = abandoned;
+        pthread_mutex_unlock(&global_heap_mutex);
+    }
+#endif
+
+    pthread_mutex_lock(&global_heap_mutex);
+    huge_entry *cached = NULL;
+    while(NULL != huge_oldest)
+    {
+        huge_entry *entry = huge_oldest;
+        huge_cache_unlink(entry);
+        entry->next = cached;
+        cached = entry;
+    }
+
+    heap_slice *slice = free_slices;
+    while(NULL != slice)
+    {
+        heap_slice *next = slice->next;
+        void *end = slice->end;
+        chunk_info *chunk = chunk_of(slice);
+
+        if(kept < pad)
+        {
+            kept += end - (void *)slice;
+        }
+        else if((void *)slice == (void *)chunk + SLAB_SIZE &&
+                end == (void *)chunk + CHUNK_SIZE &&
+                chunk != heap_current_chunk &&
+                0 == __atomic_load_n(&chunk_carvers, __ATOMIC_SEQ_CST) &&
+                0 == __atomic_load_n(&transfer_poppers, __ATOMIC_SEQ_CST))
+        {
+            unlink_free_run(slice);
+            release_chunk(chunk);
+            released = 1;
+        }
+        else if(RUN_CLEAN != slice->state)
+        {
+            decommit_free_run(slice);
+            released = 1;
+        }
+        slice = next;
+    }
+    pthread_mutex_unlock(&global_heap_mutex);
+
+    if(NULL != cached)
+    {
+        release_huge_entries(NULL, cached);
+        released = 1;
+    }
+    return released;
+}
+
+
+/*
+ * Reads malloc statistics, summed over the heaps of all threads.
+ * Counters are read without stopping the threads, so the result is a close
+ * snapshot rather than an exact one while other threads allocate.
+ * params: statistics to fill in.
+ */
+void get_malloc_statistics(malloc_statistics *stats)
+{
+    thread_heap *heap = __atomic_load_n(&all_heaps, __ATOMIC_ACQUIRE);
+
+    memset(stats, 0, sizeof(malloc_statistics));
+    stats->total_free_request =
+        __atomic_load_n(&heapless_stats.total_free_request, __ATOMIC_RELAXED);
+    stats->total_free_blocks =
+        __atomic_load_n(&heapless_stats.total_free_blocks, __ATOMIC_RELAXED);
+    stats->total_mmap_size_released =
+        __atomic_load_n(&heapless_stats.total_mmap_size_released,
+                        __ATOMIC_RELAXED);
+
+    for(; NULL != heap; heap = heap->next_heap)
+    {
+        stats->total_arena_size_allocated +=
+            __atomic_load_n(&heap->stats.total_arena_size_allocated,
+                            __ATOMIC_RELAXED);
+        stats->total_mmap_size_allocated +=
+            __atomic_load_n(&heap->stats.total_mmap_size_allocated,
+                            __ATOMIC_RELAXED);
+        stats->total_mmap_size_released +=
+            __atomic_load_n(&heap->stats.total_mmap_size_released,
+                            __ATOMIC_RELAXED);
+        stats->total_number_of_blocks +=
+            __atomic_load_n(&heap->stats.total_number_of_blocks,
+                            __ATOMIC_RELAXED);
+        stats->total_allocation_request +=
+            __atomic_load_n(&heap->stats.total_allocation_request,
+                            __ATOMIC_RELAXED);
+        stats->total_free_request +=
+            __atomic_load_n(&heap->stats.total_free_request,
+                            __ATOMIC_RELAXED);
+        stats->total_free_blocks +=
+            __atomic_load_n(&heap->stats.total_free_blocks,
+                            __ATOMIC_RELAXED);
+    }
+}
+
+
+void malloc_stats()
+{
+    malloc_statistics stats;
+    get_malloc_statistics(&stats);
+
     printf("\n -- malloc stats--\n");
-    printf("\n total_arena_size_allocated : %lu", total_arena_size_allocated);
-    printf("\n total_mmap_size_allocated  : %lu", total_mmap_size_allocated);
-    printf("\n total_number_of_blocks     : %lu", total_number_of_blocks);
-    printf("\n total_allocation_request   : %lu", total_allocation_request);
-    printf("\n total_free_request         : %lu", total_free_request);
-    printf("\n total_free_blocks          : %lu\n", total_free_blocks);
+    printf("\n total_arena_size_allocated : %lu", stats.total_arena_size_allocated);
+    printf("\n total_mmap_size_allocated  : %lu", stats.total_mmap_size_allocated);
+    printf("\n total_mmap_size_released   : %lu", stats.total_mmap_size_released);
+    printf("\n total_number_of_blocks     : %lu", stats.total_number_of_blocks);
+    printf("\n total_allocation_request   : %lu", stats.total_allocation_request);
+    printf("\n total_free_request         : %lu", stats.total_free_request);
+    printf("\n total_free_blocks          : %lu\n", stats.total_free_blocks);
 }
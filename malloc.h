@@ -1,10 +1,13 @@
 /*
  * Implements malloc library in C.
  * This malloc implemtation has per thread bins.
- * bins are according to four sizes:
- * 8 bytes, 64 bytes, 512 bytes and greated than 512 bytes.
+ * Small requests (<= 3584 bytes) are rounded up to one of the size classes
+ * below and every size class has its own bin. Requests greater than 3584
+ * bytes share one bin.
  *
- * memory for size > 512 bytes is allocated through mmap system call.
+ * Small blocks are carved out of slabs of a few pages without a header.
+ * memory for size > 3584 bytes up to 256 KB is carved as page runs from the
+ * heap, bigger blocks are allocated through mmap system call.
  * memory blocks are initialized lazily and are appended on free list after
  * free() call.
  *
@@ -13,76 +16,643 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1   // mremap()
+#endif
+
 #include <limits.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <mcheck.h>
+#include "libmalloc.h"
+#ifdef PER_CPU_HEAPS
+#include <sched.h>
+#include <sys/rseq.h>
+#endif
 
 #ifndef _MALLOC_H
 #define _MALLOC_H 1
 
 
-/* struct to hold block metadata
+/* struct to hold block metadata of blocks larger than SMALL_SIZE_MAX.
  * size represents the free block's size in bytes.
+ * state is BLOCK_IN_USE while the block is handed out, so a second free()
+ * of the same block is caught without walking the bin.
  * next points to next free block.
+ * lead is the number of bytes mapped before the header. It is 0 unless the
+ * block was mapped for an aligned allocation, where the header sits just
+ * before the aligned address. The mapping always starts lead bytes before
+ * the header and is lead + sizeof(block_info) + size bytes long.
  */
 typedef struct block_info
 {
-   int size;
+   size_t size;
+   int state;
+   unsigned int lead;
    struct block_info *next;
-}block_info;
+   struct thread_heap *owner;   // heap whose bin_large the block returns to.
+} __attribute__((aligned(16))) block_info;
+
+#define BLOCK_FREE   0
+#define BLOCK_IN_USE 0x5a5a5a5a
+
+
+/* A free small block. Small blocks carry no header, while a block is free
+ * its first word links it into the bin of its size class. The first block
+ * of a batch in the transfer cache links the next batch with its second
+ * word (every block has at least 16 bytes).
+ */
+typedef struct free_block
+{
+   struct free_block *next;
+   struct free_block *next_batch;
+}free_block;
 
 /*mutex for global heap.*/
 pthread_mutex_t global_heap_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/* mutex for updating the stats variables */
-pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Counters of free() calls from threads without a heap (threads that never
+ * called malloc, or are exiting). Updated with relaxed atomic adds.
+ */
+malloc_statistics heapless_stats;
+
+
+/*
+ * Adds n to a statistics counter of a heap. Only the owning thread writes
+ * its counters, the relaxed atomic store only keeps concurrent readers of
+ * the counters well defined, it compiles to a plain add.
+ */
+#define STATS_ADD(heap, counter, n)                                     \
+    __atomic_store_n(&(heap)->stats.counter, (heap)->stats.counter + (n), \
+                     __ATOMIC_RELAXED)
+
+
+/* Largest request served from the small size classes. */
+#define SMALL_SIZE_MAX 3584
+
+
+/*
+ * Small size classes: 16 byte steps up to 128 bytes, then four geometric
+ * steps per doubling up to SMALL_SIZE_MAX. Slabs of classes up to 512 bytes
+ * are one page, bigger classes take the few pages (at most SLAB_MAX_PAGES)
+ * that leave the least over, so a 600 byte block does not take a page.
+ * The list is expanded with X(size, pages, arg) for every class, in
+ * increasing order, to generate the tables below at compile time.
+ */
+#define SIZE_CLASS_LIST(X, arg)                                             \
+    X(16, 1, arg)   X(32, 1, arg)   X(48, 1, arg)   X(64, 1, arg)           \
+    X(80, 1, arg)   X(96, 1, arg)   X(112, 1, arg)  X(128, 1, arg)          \
+    X(160, 1, arg)  X(192, 1, arg)  X(224, 1, arg)  X(256, 1, arg)          \
+    X(320, 1, arg)  X(384, 1, arg)  X(448, 1, arg)  X(512, 1, arg)          \
+    X(640, 3, arg)  X(768, 4, arg)  X(896, 2, arg)  X(1024, 8, arg)         \
+    X(1280, 6, arg) X(1536, 5, arg) X(1792, 4, arg) X(2048, 8, arg)         \
+    X(2560, 7, arg) X(3072, 7, arg) X(3584, 8, arg)
+
+#define SLAB_MAX_PAGES 8
+
+#define SIZE_CLASS_COUNT_ONE(size, pages, arg)   + 1
+#define SIZE_CLASS_SIZE_OF(size, pages, arg)     size,
+#define SIZE_CLASS_PAGES_OF(size, pages, arg)    pages,
+#define SIZE_CLASS_COUNT_BELOW(size, pages, arg) + ((size) < (arg))
+
+/* number of small size classes. */
+#define NUM_SIZE_CLASSES (0 SIZE_CLASS_LIST(SIZE_CLASS_COUNT_ONE, 0))
+
+/* size class index of the smallest class that can hold 'bytes' bytes. */
+#define SIZE_TO_CLASS(bytes) (0 SIZE_CLASS_LIST(SIZE_CLASS_COUNT_BELOW, bytes))
+
+/* block size of every size class. */
+static const unsigned short size_class_size[NUM_SIZE_CLASSES] =
+{
+    SIZE_CLASS_LIST(SIZE_CLASS_SIZE_OF, 0)
+};
+
+/* pages of a slab of every size class. */
+static const unsigned char size_class_pages[NUM_SIZE_CLASSES] =
+{
+    SIZE_CLASS_LIST(SIZE_CLASS_PAGES_OF, 0)
+};
+
+/*
+ * Size to class lookup, indexed by request size in 16 byte granules
+ * ((size + 15) >> 4). Every entry is evaluated by the compiler.
+ */
+#define SIZE_CLASS_LOOKUP_1(g)  SIZE_TO_CLASS((g) << 4),
+#define SIZE_CLASS_LOOKUP_4(g)  SIZE_CLASS_LOOKUP_1(g) SIZE_CLASS_LOOKUP_1((g) + 1) \
+                                SIZE_CLASS_LOOKUP_1((g) + 2) SIZE_CLASS_LOOKUP_1((g) + 3)
+#define SIZE_CLASS_LOOKUP_16(g) SIZE_CLASS_LOOKUP_4(g) SIZE_CLASS_LOOKUP_4((g) + 4) \
+                                SIZE_CLASS_LOOKUP_4((g) + 8) SIZE_CLASS_LOOKUP_4((g) + 12)
+#define SIZE_CLASS_LOOKUP_64(g) SIZE_CLASS_LOOKUP_16(g) SIZE_CLASS_LOOKUP_16((g) + 16) \
+                                SIZE_CLASS_LOOKUP_16((g) + 32) SIZE_CLASS_LOOKUP_16((g) + 48)
+
+static const unsigned char size_class_lookup[(SMALL_SIZE_MAX >> 4) + 1] =
+{
+    SIZE_CLASS_LOOKUP_64(0) SIZE_CLASS_LOOKUP_64(64) SIZE_CLASS_LOOKUP_64(128)
+    SIZE_CLASS_LOOKUP_16(192) SIZE_CLASS_LOOKUP_16(208) SIZE_CLASS_LOOKUP_1(224)
+};
+
+_Static_assert(sizeof(size_class_lookup) == (SMALL_SIZE_MAX >> 4) + 1,
+               "size class lookup table does not cover SMALL_SIZE_MAX");
+
+
+/*
+ * Small blocks are carved out of slabs. A slab is size_class_pages SLAB_SIZE
+ * pages from the heap holding blocks of a single size class back to back.
+ * The slab_info header at the start of its first page records the size
+ * class and which blocks are free, so free() finds the size of a block from
+ * its page (see chunk_info.slab_page for slabs of more than one page).
+ */
+#define SLAB_SIZE 4096
+
+/* number of words in the free bitmap of a slab (one bit per block, as many
+   as 16 byte blocks in one page). */
+#define SLAB_MAP_BITS  (8 * sizeof(unsigned long))
+#define SLAB_MAP_WORDS (SLAB_SIZE / 16 / SLAB_MAP_BITS)
+
+typedef struct slab_info
+{
+   unsigned short size_class;   // index into size_class_size.
+   unsigned short next_unused;  // first block never handed out yet.
+   unsigned short dirty;        // page was not zero when the slab was made.
+   struct thread_heap *owner;   // heap whose bins the blocks return to.
+   unsigned long  free_map[SLAB_MAP_WORDS]; // bit set = block is free.
+}slab_info;
+
+/*
+ * Blocks start at the first offset past the header that is aligned to the
+ * largest power of two dividing the class size, so every block is naturally
+ * aligned. size & -size is that power of two.
+ */
+#define SLAB_FIRST_BLOCK(size) \
+    ((sizeof(slab_info) + ((size) & -(size)) - 1) & ~(((size) & -(size)) - 1))
+#define SIZE_CLASS_FIRST_BLOCK_OF(size, pages, arg) SLAB_FIRST_BLOCK(size),
+#define SIZE_CLASS_NUM_BLOCKS_OF(size, pages, arg) \
+    (((pages) * SLAB_SIZE - SLAB_FIRST_BLOCK(size)) / (size)),
+
+/*
+ * ceil(2^32 / size). For an offset that is a multiple of size,
+ * (offset * magic) >> 32 == offset / size, which saves a division in free().
+ */
+#define SIZE_CLASS_DIV_MAGIC_OF(size, pages, arg) \
+    (unsigned int)(((1ULL << 32) + (size) - 1) / (size)),
+
+/* offset of the first block in a slab of every size class. */
+static const unsigned short size_class_first_block[NUM_SIZE_CLASSES] =
+{
+    SIZE_CLASS_LIST(SIZE_CLASS_FIRST_BLOCK_OF, 0)
+};
+
+/* number of blocks in a slab of every size class. */
+static const unsigned short size_class_num_blocks[NUM_SIZE_CLASSES] =
+{
+    SIZE_CLASS_LIST(SIZE_CLASS_NUM_BLOCKS_OF, 0)
+};
+
+static const unsigned int size_class_div_magic[NUM_SIZE_CLASSES] =
+{
+    SIZE_CLASS_LIST(SIZE_CLASS_DIV_MAGIC_OF, 0)
+};
+
+/* every block of a slab has its bit in free_map. */
+#define SIZE_CLASS_MAP_OVERFLOW(size, pages, arg) \
+    + (((pages) * SLAB_SIZE - SLAB_FIRST_BLOCK(size)) / (size) > \
+       SLAB_MAP_WORDS * SLAB_MAP_BITS)
+_Static_assert(0 SIZE_CLASS_LIST(SIZE_CLASS_MAP_OVERFLOW, 0) == 0,
+               "a slab has more blocks than its free bitmap");
+
+
+/*
+ * Medium blocks, SMALL_SIZE_MAX < size <= MEDIUM_SIZE_MAX, are runs of pages
+ * carved from the thread heap like slabs and headed by a block_info like
+ * mapped blocks, so they share bin_large and the large block code paths.
+ * The pages of a run are rounded up to a medium size class: every count up
+ * to MEDIUM_EXACT_PAGES, then four classes per doubling up to
+ * MEDIUM_MAX_PAGES. A medium block is told from a mapped one by being
+ * inside a chunk, and from a slab block by starting sizeof(block_info)
+ * bytes into its page, before the first block of any slab. Slabs of more
+ * than one page have blocks in later pages too, but these are aligned to
+ * more than sizeof(block_info) bytes (see SLAB_FIRST_BLOCK()), so none
+ * starts at that offset either.
+ */
+#define MEDIUM_EXACT_PAGES 8
+#define MEDIUM_MAX_PAGES   64
+#define MEDIUM_SIZE_MAX    (MEDIUM_MAX_PAGES * SLAB_SIZE - sizeof(block_info))
+
+#define SIZE_CLASS_MEDIUM_CLASH(size, pages, arg) \
+    + ((pages) > 1 && ((size) & -(size)) <= sizeof(block_info))
+_Static_assert(sizeof(slab_info) > sizeof(block_info) &&
+               0 SIZE_CLASS_LIST(SIZE_CLASS_MEDIUM_CLASH, 0) == 0,
+               "slab blocks and medium blocks can start at the same offset");
+
+
+/*
+ * Index of free large blocks (two level segregated fit).
+ * The first level splits sizes by power of two, the second level splits
+ * every power of two into LARGE_SL_COUNT equal ranges, bins[fl][sl] is a
+ * list of blocks in that range. fl_map has bit fl set when any bin of row fl
+ * is non empty and sl_map[fl] has bit sl set when bins[fl][sl] is non empty,
+ * so the smallest non empty bin that fits a request is found with two bit
+ * scans and removing its head is constant time.
+ */
+#define LARGE_SL_BITS  2
+#define LARGE_SL_COUNT (1 << LARGE_SL_BITS)
+#define LARGE_FL_COUNT (8 * sizeof(size_t))
+
+/*
+ * Blocks are whole pages minus their header, so they sit just below bin
+ * boundaries and a request rounded up to the next bin would skip the bin
+ * holding blocks of exactly the size it creates. That bin is searched
+ * first, up to LARGE_BIN_SCAN blocks deep.
+ */
+#define LARGE_BIN_SCAN 8
+
+/*
+ * A block in bin_large has the time it was cached, in ms, in the first word
+ * after its header. Blocks cached for dirty_decay_ms are given back by
+ * decay_large_bins(), which runs at most every dirty_decay_ms / 2.
+ */
+typedef struct large_bins
+{
+   unsigned long fl_map;
+   unsigned char sl_map[LARGE_FL_COUNT];
+   block_info   *bins[LARGE_FL_COUNT][LARGE_SL_COUNT];
+   size_t        bytes;      // bytes of all blocks in the bins.
+   unsigned long decay_at;   // time of the next decay_large_bins() pass.
+}large_bins;
+
+
+/*
+ * Per thread heap. Every slab and large block records the heap it was
+ * allocated from, its owner.
+ *
+ * small_bins: one bin per small size class and bin_large for every thing
+ * else greater than SMALL_SIZE_MAX bytes. Iniially all the bins are empty.
+ * The list gets build up on successive free calls after malloc. Bins are
+ * only touched by the owning thread.
+ *
+ * current_slab: slab of every size class from which the thread carves
+ * blocks that were never handed out yet. Cleared once the slab is fully
+ * carved, so only bins point into a slab that may be released.
+ *
+ * bin_count, bin_fresh: blocks in each small bin, and how many of them were
+ * carved by refill_bin() and never handed out. Carved blocks only count as
+ * fresh when the bin was empty and freed blocks are pushed on top, so the
+ * fresh blocks are always the last bin_fresh ones. They are zero apart
+ * from their next pointer.
+ *
+ * sweep_credit: blocks of the slabs of each class that were found all free
+ * but could not be released from the bin alone, since the last
+ * sweep_small_class() (see release_empty_slab()).
+ *
+ * refill_batch: blocks carved by the next refill of each small bin.
+ *
+ * remote_free: blocks freed by other threads. Any thread pushes a block with
+ * a compare and swap on the head, the owner takes the whole list with one
+ * atomic exchange on its next allocation miss and puts the blocks back in
+ * its bins (a lock free multi producer, single consumer queue).
+ *
+ * trim_pending: set by malloc_trim() in another thread, the owner runs
+ * trim_heap() on its next small bin miss or large free.
+ *
+ * deferred_runs, deferred_unmaps: pages and mapped blocks given back under
+ * the lock of a CPU heap, handed to flush_deferred() by unlock_heap().
+ *
+ * stats: malloc statistics of the heap (see libmalloc.h). Only the owning
+ * thread writes them, so counting never takes a lock or shares a cache line
+ * between threads. malloc_stats() and get_malloc_statistics() add up the
+ * copies of all heaps.
+ */
+typedef struct thread_heap
+{
+   free_block *small_bins[NUM_SIZE_CLASSES];
+   large_bins  bin_large;
+   slab_info  *current_slab[NUM_SIZE_CLASSES];
+   unsigned int bin_count[NUM_SIZE_CLASSES];
+   unsigned int bin_fresh[NUM_SIZE_CLASSES];
+   unsigned short refill_batch[NUM_SIZE_CLASSES];
+   unsigned int sweep_credit[NUM_SIZE_CLASSES];
+   struct thread_heap *next_heap;   // list of all heaps.
+   struct thread_heap *abandoned_next;
+   malloc_statistics stats;
+
+   // written by other threads, kept on its own cache line.
+   free_block *remote_free __attribute__((aligned(64)));
+   int trim_pending;
+#ifdef PER_CPU_HEAPS
+   int lock;   // held by the thread using the heap of a CPU.
+   struct heap_slice *deferred_runs;
+   block_info *deferred_unmaps;
+#endif
+}thread_heap;
+
+
+/*
+ * A small bin miss carves a batch of blocks from the slab of its class into
+ * the bin. The batch starts at REFILL_BATCH_MIN blocks and doubles on every
+ * refill up to REFILL_BATCH_MAX (slow start), so classes a thread uses a
+ * lot are refilled rarely and classes it hardly uses don't hold memory.
+ * A new heap has the bins of its PREPOPULATE_CLASSES smallest classes, the
+ * most used ones, filled before the first block is handed out.
+ */
+#define REFILL_BATCH_MIN    4
+#define REFILL_BATCH_MAX    64
+#define PREPOPULATE_CLASSES 8
+
+
+/*
+ * Central transfer cache: free small blocks shared by all threads, one
+ * stack of batches per size class. A thread whose bin grows past
+ * BIN_HIGH_WATER blocks pushes TRANSFER_BATCH of them, already linked
+ * through next, with one compare and swap. A thread whose bin is empty pops
+ * a whole batch the same way before it carves new blocks.
+ * The head packs a 16 bit tag above the 48 bit address of the first batch
+ * and every push and pop bumps the tag, so a pop that read a head which
+ * was popped and pushed again in between fails its compare and swap (the
+ * ABA problem).
+ */
+#define TRANSFER_BATCH    32
+#define BIN_HIGH_WATER    (4 * TRANSFER_BATCH)
+#define TRANSFER_PTR_MASK ((1UL << 48) - 1)
+#define TRANSFER_TAG_ONE  (1UL << 48)
+
+typedef struct transfer_cache
+{
+   unsigned long head;      // tag << 48 | first batch.
+   unsigned long batches;   // batches in the stack, for sweep pacing.
+} __attribute__((aligned(64))) transfer_cache;
+
+transfer_cache transfer_caches[NUM_SIZE_CLASSES];
+
+/*
+ * threads in transfer_pop(). A pop may read the link of a batch that was
+ * popped, used and freed meanwhile, so chunks are only unmapped while it
+ * is zero, like chunk_carvers.
+ */
+unsigned long transfer_poppers = 0;
+
+
+/*
+ * A slab whose blocks are all free can only be given back once one thread
+ * holds all of them, but BIN_HIGH_WATER is below the blocks of a slab of
+ * the smallest classes and the rest of the blocks sit in the transfer
+ * cache. sweep_small_class() empties the transfer cache of a class into the
+ * bin of the calling thread and counts the blocks of every slab in a table
+ * on its stack, SWEEP_SLABS slabs at most, each found within SWEEP_PROBES
+ * slots of its hash. Slabs with all their blocks there are released.
+ * release_empty_slab() sweeps once the blocks of the slabs it found all
+ * free add up to 7/8 of what a sweep walks: each block is walked a bounded
+ * number of times, and a class that is still being freed is left alone
+ * until it is mostly free, so its slabs are not released and carved again.
+ */
+#define SWEEP_SLABS  256
+#define SWEEP_PROBES 8
+
+typedef struct sweep_entry
+{
+   slab_info   *slab;
+   unsigned int count;   // blocks of the slab found.
+}sweep_entry;
+
+
+/*
+ * Freed large blocks of at least large_unmap_threshold bytes go to the huge
+ * cache with their pages. Smaller ones are kept in bin_large for reuse
+ * until the heap holds large_cache_max bytes, the pages of mapped ones are
+ * given back with madvise while they wait. 1 MB keeps the blocks that are
+ * worth a syscall and page faults to refill in the huge cache. Both can be
+ * set from the environment with MALLOC_LARGE_UNMAP_THRESHOLD and
+ * MALLOC_LARGE_CACHE_MAX (bytes).
+ */
+size_t large_unmap_threshold = 1UL << 20;
+size_t large_cache_max       = 32UL << 20;
+
+
+/*
+ * Huge block cache. Mapped blocks of at least large_unmap_threshold bytes,
+ * freed by any thread, are kept here with their pages instead of being
+ * unmapped, so the next request of about the same size from any thread gets
+ * one back without a syscall or page faults. Blocks are bucketed like
+ * bin_large (large_bin_index()), most recently freed first, and a request
+ * only takes a block from its own bucket, LARGE_BIN_SCAN entries deep, or
+ * the HUGE_CACHE_FIT_BUCKETS - 1 above it, less than twice its size. All
+ * entries are also on one list by age: entries freed more than
+ * huge_cache_decay_ms ago, and the oldest ones while the cache holds more
+ * than huge_cache_max bytes, are unmapped on the next put or get, or only
+ * by the purge thread with background purging. The entry is written at the
+ * start of the free block. Protected by global_heap_mutex. Both limits can
+ * be set from the environment with MALLOC_HUGE_CACHE_MAX (bytes) and
+ * MALLOC_HUGE_CACHE_DECAY_MS.
+ */
+typedef struct huge_entry
+{
+   struct huge_entry *next;    // bucket list, most recently freed first.
+   struct huge_entry *prev;
+   struct huge_entry *older;   // age list.
+   struct huge_entry *newer;
+   unsigned long freed_at;     // CLOCK_MONOTONIC time in ms.
+}huge_entry;
+
+#define HUGE_CACHE_BUCKETS     (LARGE_FL_COUNT * LARGE_SL_COUNT)
+#define HUGE_CACHE_FIT_BUCKETS LARGE_SL_COUNT
+
+huge_entry *huge_buckets[HUGE_CACHE_BUCKETS];
+huge_entry *huge_oldest = NULL;
+huge_entry *huge_newest = NULL;
+size_t huge_cache_bytes = 0;
+
+size_t        huge_cache_max      = 64UL << 20;
+unsigned long huge_cache_decay_ms = 10000;
 
 
-// total arena size allocated in bytes.
-unsigned long total_arena_size_allocated = 0;
+/*
+ * What free() writes over a block, set from the environment with
+ * MALLOC_FREE_FILL=none|zero|junk. Nothing is written by default. Junk fill
+ * uses FREE_JUNK_BYTE so reads of freed memory stand out. Blocks are
+ * filled in full, except mapped blocks cached in bin_large: only up to the
+ * end of their header page, their other pages are dropped.
+ */
+#define FREE_FILL_NONE 0
+#define FREE_FILL_ZERO 1
+#define FREE_FILL_JUNK 2
+#define FREE_JUNK_BYTE 0x5a
+
+int free_fill = FREE_FILL_NONE;
+
+
+/* heap of the calling thread, created on first malloc. */
+__thread thread_heap *current_heap = NULL;
+
+/* every heap ever created, linked through next_heap. */
+thread_heap *all_heaps = NULL;
+
+/*
+ * Heaps of exited threads, linked through abandoned_next. A dying thread
+ * leaves its bins, slabs and remote_free queue here, and a new thread
+ * adopts such a heap before it creates a new one. Protected by
+ * global_heap_mutex.
+ */
+thread_heap *abandoned_heaps = NULL;
 
-// total size allocated through mmap system call.
-unsigned long total_mmap_size_allocated = 0;
+/* thread key whose destructor abandons the heap of an exiting thread. */
+pthread_key_t thread_heap_key;
+pthread_once_t thread_heap_key_once = PTHREAD_ONCE_INIT;
 
-// total number of blocks in heap.
-unsigned long total_number_of_blocks = 0;
 
-// total number of allocation done. It is count of number of times malloc called
-unsigned long total_allocation_request = 0;
+/*
+ * Per-CPU mode, built with -DPER_CPU_HEAPS (make PER_CPU=1). There is one
+ * heap per CPU instead of one per thread, so cached memory grows with the
+ * number of cores rather than threads. A thread uses the heap of the CPU
+ * it runs on, read from the rseq area glibc registers for every thread
+ * (sched_getcpu() when there is none), and holds the spin lock of the heap
+ * while it uses it. The thread may move to another CPU meanwhile, the lock
+ * keeps the heap consistent, it is just shared for a moment. CPU heaps live
+ * as long as the process, only the unused rest of the thread heap slice of
+ * an exiting thread is given back.
+ */
+#ifdef PER_CPU_HEAPS
+#define MAX_CPU_HEAPS   1024
+#define HEAP_LOCK_SPINS 100
 
-// total free requests made.
-unsigned long total_free_request = 0;
+thread_heap *cpu_heaps[MAX_CPU_HEAPS];
 
-// total number of free blocks available (of all threads.)
-unsigned long total_free_blocks = 0;
+/* set once the thread registered thread_heap_key for its slice. */
+__thread int thread_key_set = 0;
+#endif
 
 
-/* Four bins of size 8 byte, 64 byte, 512 byte and every thing else greater
- *  than 512 bytes.
+/*
+ * The global heap is made of chunks: CHUNK_SIZE regions reserved with mmap
+ * at CHUNK_SIZE alignment. The first page of a chunk holds its chunk_info,
+ * the remaining pages are handed to threads as thread heaps.
  *
- * Each thread will have its own bin and storage arena.
- * Iniially all the bins are empty. The list gets build up on successive free
- * calls after malloc.
+ * A chunk is reserved without access rights. Pages are committed
+ * (made read/write) in CHUNK_COMMIT_STEP steps as threads carve into the
+ * chunk and can be decommitted (returned to the kernel) page by page with
+ * decommit_pages(). Every chunk is an independent mapping, so it can be
+ * unmapped on its own with release_chunk().
+ */
+#define CHUNK_SHIFT       21
+#define CHUNK_SIZE        (1UL << CHUNK_SHIFT)
+#define CHUNK_COMMIT_STEP (64UL * SLAB_SIZE)
+
+/* pages of the thread heap taken from the global heap at a time. */
+#define THREAD_HEAP_SIZE  (16UL * SLAB_SIZE)
+
+/* pages in a chunk, the first one holds chunk_info. */
+#define CHUNK_PAGES       (CHUNK_SIZE / SLAB_SIZE)
+
+typedef struct chunk_info
+{
+   struct chunk_info *next_chunk;   // list of all chunks.
+   void *committed_end;             // pages below are read/write.
+   unsigned long frontier;          // offset of the first byte not yet
+                                    // handed out, bumped with fetch-add.
+   unsigned int free_pages;         // pages in free runs of free_slices.
+   // boundary tags of the free runs in free_slices: the length in pages
+   // of a run on its first and last page, 0 on all other pages.
+   unsigned short free_run[CHUNK_PAGES];
+   // index of every slab page inside its slab, so slab_of() finds the
+   // first page of a slab of more than one page. SLAB_PAGE_ALIGNED on the
+   // page an aligned medium block starts in.
+   unsigned char slab_page[CHUNK_PAGES];
+}chunk_info;
+
+/*
+ * Aligned medium blocks start at the alignment inside their run instead of
+ * sizeof(block_info) bytes into it, where slab blocks start too. The page
+ * they start in is marked, so is_small_block() still tells them apart.
+ * Slabs rewrite the mark of their pages when they are made.
+ */
+#define SLAB_PAGE_ALIGNED 0xff
+
+
+/*
+ * Chunk map: a two level radix tree from address >> CHUNK_SHIFT to the
+ * chunk_info of the chunk, covering a 48 bit address space. free() uses it
+ * to tell blocks inside chunks (slabs) from large blocks mapped on their
+ * own. Leaves are mapped on first use, entries only change under
+ * global_heap_mutex and are read without a lock.
+ */
+#define CHUNK_MAP_BITS      (48 - CHUNK_SHIFT)
+#define CHUNK_MAP_LEAF_BITS 14
+#define CHUNK_MAP_ROOT_BITS (CHUNK_MAP_BITS - CHUNK_MAP_LEAF_BITS)
+
+chunk_info **chunk_map[1UL << CHUNK_MAP_ROOT_BITS];
+
+/* every chunk currently mapped, linked through next_chunk. */
+chunk_info *all_chunks = NULL;
+
+/*
+ * chunk the global heap is currently carved from. Read without a lock,
+ * replaced under global_heap_mutex when its frontier passes its end.
+ */
+chunk_info *heap_current_chunk = NULL;
+
+/*
+ * threads in carve_thread_heap() that may touch the chunk they loaded from
+ * heap_current_chunk. Chunks are only unmapped while it is zero.
  */
-__thread block_info *bin_8     = NULL;
-__thread block_info *bin_64    = NULL;
-__thread block_info *bin_512   = NULL;
-__thread block_info *bin_large = NULL;
+unsigned long chunk_carvers = 0;
 
 
 /*
- * A pointer to heap memory upto which the heap addresses are assigned to
- * the threads of process. Addresses beyond this upto heap end are available
- * for future thread of more memory expansion to threads.
+ * A free run of pages of the global heap: the unused rest of a thread heap,
+ * slabs whose blocks were all freed or medium blocks. The struct is written
+ * at the start of the free range itself. The rest of a RUN_CLEAN run is
+ * zero. A RUN_DIRTY run still holds old data in resident pages, a
+ * RUN_MUZZY run was given to the kernel with MADV_FREE, its pages may read
+ * old data or zero. Merged runs take the dirtiest state of their parts.
  */
-void *heap_used_memory_end = NULL;
+#define RUN_CLEAN 0
+#define RUN_MUZZY 1
+#define RUN_DIRTY 2
+
+typedef struct heap_slice
+{
+   struct heap_slice *next;
+   struct heap_slice *prev;
+   void *end;
+   int state;                   // RUN_CLEAN, RUN_MUZZY or RUN_DIRTY.
+   unsigned long changed_at;    // time in ms it got its state.
+}heap_slice;
+
+/*
+ * Free runs of the global heap. Threads take memory from here before they
+ * carve into heap_current_chunk. A run given back is merged with the free
+ * runs right before and after it, found from the boundary tags in
+ * chunk_info, so pages freed by different size classes and threads add up
+ * to runs any request can use. Protected by global_heap_mutex, threads
+ * check it is empty without the lock.
+ */
+heap_slice *free_slices = NULL;
+
+/*
+ * Pages given back to free_slices by free() are not decommitted one by
+ * one. They go back RUN_DIRTY, and once free_dirty_bytes, the bytes of
+ * runs that are not RUN_CLEAN, passes dirty_purge_at, the oldest dirty
+ * runs are decommitted in one pass until half of dirty_max is left. By
+ * then they are merged with their neighbours, so one madvise() covers many
+ * slabs and medium blocks, and pages reused before that are not faulted in
+ * again. dirty_purge_at is dirty_max plus the dirty bytes the last pass
+ * had to skip (see may_break_hugepage()). dirty_max is set with
+ * MALLOC_DIRTY_MAX (bytes). Protected by global_heap_mutex. With
+ * background purging the purge thread does this instead.
+ */
+#define PURGE_BATCH 64  // runs decommitted per unlock of global_heap_mutex
+size_t dirty_max        = 32UL << 20;
+size_t dirty_purge_at   = 32UL << 20;
+size_t free_dirty_bytes = 0;
 
 /*
  *  pointer to a location from which hepa memory allocated to thread has not
@@ -97,6 +667,44 @@ __thread void *thread_unused_heap_start = NULL;
  */
 __thread void *thread_heap_end = NULL;
 
+/* the thread heap was taken from a free run that was not RUN_CLEAN. */
+__thread int thread_heap_dirty = 0;
+
+
+/*
+ * Background purging, enabled with MALLOC_BACKGROUND_PURGE=1. Free runs and
+ * slabs and medium blocks given back to the heap are then left dirty
+ * instead of being decommitted by free(). A thread started from
+ * sharedLibConstructor() wakes up every purge_interval_ms, gives free runs
+ * that stayed RUN_DIRTY for dirty_decay_ms to the kernel with MADV_FREE,
+ * and drops runs that stayed RUN_MUZZY for muzzy_decay_ms with
+ * MADV_DONTNEED. It also expires the huge cache, the only one to do so:
+ * cache_huge_block() signals purge_wake to wake it up early once the cache
+ * holds more than huge_cache_max bytes. The decay times are set with
+ * MALLOC_DIRTY_DECAY_MS and MALLOC_MUZZY_DECAY_MS.
+ */
+#define PURGE_INTERVAL_MIN_MS 10
+#define PURGE_INTERVAL_MAX_MS 1000
+
+pthread_cond_t purge_wake = PTHREAD_COND_INITIALIZER;
+
+int           background_purge = 0;
+unsigned long dirty_decay_ms   = 10000;
+unsigned long muzzy_decay_ms   = 10000;
+
+/*
+ * Transparent huge pages, enabled with MALLOC_HUGEPAGES=1. A chunk is one
+ * 2 MB huge page: it is committed in full when it is mapped and marked
+ * MADV_HUGEPAGE. Thread heaps are taken from the free run in the chunk
+ * with the fewest free pages, so slabs are packed into the fullest huge
+ * pages and the others can empty out. Free pages of a chunk stay resident,
+ * which keeps its huge page whole, until at least HUGEPAGE_BREAK_PAGES of
+ * its pages are free; only then are they decommitted or purged.
+ */
+#define HUGEPAGE_BREAK_PAGES (CHUNK_PAGES / 2)
+
+int transparent_hugepages = 0;
+
 
 
 /*
@@ -110,110 +718,991 @@ void * align8(void *x);
 
 
 /*
- *  returns the pointer to elated bin based on the size.
- *  params: size of bin.
- *  returns: pointer to bin corresponding size.
+ * Maps a small request size (<= SMALL_SIZE_MAX) to its size class index.
+ * params: requested size in bytes.
+ * returns: index into size_class_size and small_bins.
  */
-block_info ** get_bin(size_t size);
+unsigned int size_to_class(size_t size);
 
 
 
 
 /*
- * Allocate memory from heap area. For memory request of sizes < 512, chunks are
- * allocated from heap.
- * params : size.
- * returns: pointer to allocated area.
+ * Finds the smallest size class holding size bytes whose blocks are aligned
+ * to alignment.
+ * params: requested size (<= SMALL_SIZE_MAX), alignment (power of two).
+ * returns: size class index, NUM_SIZE_CLASSES when no class fits.
  */
-void * heap_allocate(size_t size);
+unsigned int aligned_size_class(size_t size, size_t alignment);
 
 
 
 
 /*
- * Finds best fit block from bin_large. On memory request > 512, first
- * it is checked if any of large free memory chunks fits to request.
- *
- * params: size of block to allocate.
- * returns: pointer to best fitting block, NULL on failure.
+ * returns the slab holding a small block.
+ * params: pointer to a block inside the heap.
+ * returns: slab header of the page of the block.
  */
-void * find_best_fit_from_bin_large(size_t size);
+slab_info * slab_of(void *p);
+
 
 
 
 /*
- * maps new memory address using mmap system call for size request > 512 bytes.
- * params: requested size in bytes.
- * returns: pointer to block allocated., NULL on failure.
+ * returns the index of a block inside its slab.
+ * params: slab of the block and pointer to the block.
+ * returns: block index, the bit of the block in slab->free_map.
  */
-void * mmap_new_memory(size_t size);
+unsigned int slab_block_index(slab_info *slab, void *p);
+
 
 
 
 /*
- * Performs allocation for request > 512 bytes.
- * params : requested memory size.
- * returns: pointer to allocated memory. NULL on failure.
+ * returns the chunk holding an address.
+ * params: any address.
+ * returns: chunk_info of the chunk, NULL if p is not inside a chunk.
  */
-void * alloc_large(size_t size);
+chunk_info * chunk_lookup(void *p);
 
 
 
 
 /*
- *  Creates a memory block from unused heap.
- *  params: requested memory size in bytes.
- *  returns: pointer to allocated memory chunk. NULL on failure.
+ * Records a chunk in the chunk map. Called with global_heap_mutex held.
+ * params: chunk to add, or NULL to remove the entry of address p.
+ * returns: 0 on success, -1 if a leaf of the map can't be mapped.
  */
-void * block_from_unused_heap(size_t size);
+int chunk_map_set(void *p, chunk_info *chunk);
 
 
 
 
 /*
- * Allocates the memory.
+ * Reserves a new chunk. Called with global_heap_mutex held.
+ * returns: new chunk, NULL on failure.
  */
-void * malloc(size_t);
+chunk_info * new_chunk(void);
 
 
 
 
 /*
- * Free up the memory allocated at pointer p. It appends the block into free
- * list.
- * params: address to pointer to be freed.
- * returns: NONE.
+ * Unmaps a chunk whose pages are all free. Called with global_heap_mutex
+ * held.
+ * params: chunk to release.
  */
-void free(void *p);
+void release_chunk(chunk_info *chunk);
 
 
 
 
 /*
- * Allocate size of size bytes for nmemb. Initialize with null bytes.
- * params: total number of elements of size 'size' to be allocated. and size
- *         to allocate.
- * returns: pointer to allocated memory on success. NULL on failure.
+ * returns the chunk holding a pointer.
+ * params: pointer inside a chunk.
+ * returns: chunk_info of the chunk.
  */
-void * calloc(size_t nmemb, size_t size);
+chunk_info * chunk_of(void *p);
 
 
 
 
 /*
- * reallocates the pointer with new size size and copies the old data to new
- * location.
- * params: pointer to reallocate. and new size.
- * returns: pointer to new allocated memory chunk.
+ * Makes pages of a chunk read/write up to end.
+ * params: chunk, end of the range to commit.
+ * returns: 0 on success, -1 on failure.
  */
-void * realloc(void *ptr, size_t size);
+int commit_pages(chunk_info *chunk, void *end);
 
 
 
 
-/* aligns memory.
+/*
+ * Gives pages back to the kernel. They stay reserved and read zero on the
+ * next touch.
+ * params: page aligned start and length.
  */
-void * memalign(size_t alignment, size_t s);
+void decommit_pages(void *start, size_t length);
+
+
+
+
+/*
+ * Checks if a pointer was handed out from a slab of the heap.
+ * params: pointer returned by malloc.
+ * returns: 1 if p is a small block, 0 otherwise.
+ */
+int is_small_block(void *p);
+
+
+
+
+/*
+ * returns the usable size of a block returned by malloc.
+ * params: pointer returned by malloc.
+ * returns: size of the block in bytes.
+ */
+size_t block_size(void *p);
+
+
+
+
+/*
+ * Checks if a block with a block_info header is a medium block.
+ * params: block header.
+ * returns: 1 if the block lives in a chunk, 0 if it is mapped on its own.
+ */
+int is_medium_block(block_info *block);
+
+
+
+
+/*
+ * returns the heap of the calling thread, creating it on first use.
+ * returns: heap of the thread, NULL on failure.
+ */
+thread_heap * get_thread_heap(void);
+
+
+
+
+/*
+ * Thread key destructor. Carves the rest of the current slabs and sweeps
+ * the small bins, so empty slabs are given back and whole batches go to
+ * the transfer caches. Gives the unused part of the thread heap back to
+ * free_slices, unmaps the cached large blocks and leaves the heap with
+ * fewer than TRANSFER_BATCH blocks per bin on abandoned_heaps for the next
+ * new thread.
+ * params: heap of the exiting thread.
+ */
+void thread_heap_exit(void *arg);
+
+
+
+
+/*
+ * Creates thread_heap_key. Called once.
+ */
+void create_thread_heap_key(void);
+
+
+
+
+/*
+ * Maps a new empty heap and links it in all_heaps. Called with
+ * global_heap_mutex held.
+ * returns: new heap, NULL on failure.
+ */
+thread_heap * create_heap(void);
+
+
+
+
+/*
+ * Gives the unused rest of the thread heap slice of the calling thread back
+ * to free_slices.
+ */
+void release_thread_slice(void);
+
+
+
+
+#ifdef PER_CPU_HEAPS
+/*
+ * thread_heap_key destructor in per-CPU mode, gives the slice back.
+ * params: unused.
+ */
+void thread_slice_exit(void *arg);
+
+
+
+
+/*
+ * returns the CPU the calling thread runs on, from its rseq area or
+ * sched_getcpu(), modulo MAX_CPU_HEAPS.
+ */
+unsigned int current_cpu(void);
+
+
+
+
+/*
+ * returns the heap of a CPU, creating it on first use.
+ * params: CPU index.
+ * returns: heap of the CPU, NULL on failure.
+ */
+thread_heap * get_cpu_heap(unsigned int cpu);
+
+
+
+
+/*
+ * Takes the spin lock of a CPU heap.
+ * params: heap to lock.
+ */
+void heap_lock(thread_heap *heap);
+
+
+
+
+/*
+ * Gives back the page ranges and unmaps the blocks deferred under the lock
+ * of a CPU heap, after the lock is let go.
+ * params: ranges linked through next with their end in end, like free
+ *         runs, blocks linked through next. Either may be NULL.
+ */
+void flush_deferred(struct heap_slice *run, block_info *block);
+#endif
+
+
+
+
+/*
+ * Returns the heap the calling thread allocates from. In per-CPU mode that
+ * is the heap of its CPU, returned locked.
+ * params: 0 to not create a thread heap (free() never does).
+ * returns: heap to use, may be NULL. Must be passed to unlock_heap().
+ */
+thread_heap * lock_heap(int create);
+
+
+
+
+/*
+ * Releases a heap returned by lock_heap().
+ * params: heap returned by lock_heap(), may be NULL.
+ */
+void unlock_heap(thread_heap *heap);
+
+
+
+
+/*
+ * Takes the lock of a CPU heap again after unlock_heap(), around a slow
+ * path that needs no heap state. Does nothing with thread heaps.
+ * params: heap returned by lock_heap().
+ */
+void relock_heap(thread_heap *heap);
+
+
+
+
+/*
+ * Hands a block freed by another thread to its owner heap.
+ * Lock free, can be called from any thread.
+ * params: owner heap, and pointer to block already marked free.
+ */
+void push_remote_free(thread_heap *heap, void *p);
+
+
+
+
+/*
+ * Moves all blocks freed by other threads back to the bins of the heap.
+ * Must be called by the owning thread.
+ * params: heap of the calling thread.
+ * returns: number of blocks reclaimed.
+ */
+int reclaim_remote_free(thread_heap *heap);
+
+
+
+
+/*
+ * Takes a fresh slab for a size class from the thread heap.
+ * params: owner heap, size class index.
+ * returns: initialized slab, NULL on failure.
+ */
+slab_info * new_slab(thread_heap *heap, unsigned int size_class);
+
+
+
+
+/*
+ * Gives the pages of a fully carved slab whose blocks are all free back to
+ * free_slices, if all the blocks are in the bin of the calling heap.
+ * Otherwise the class is swept once enough such slabs add up.
+ * params: heap of the calling thread, slab.
+ */
+void release_empty_slab(thread_heap *heap, slab_info *slab);
+
+
+
+
+/*
+ * Finds the entry of a slab in a sweep table, adding it if it is not
+ * there yet.
+ * params: table of SWEEP_SLABS entries, slab.
+ * returns: entry of the slab, NULL if its slots are taken by other slabs.
+ */
+sweep_entry * sweep_lookup(sweep_entry *table, slab_info *slab);
+
+
+
+
+/*
+ * Empties the transfer cache of a class into the bin of the calling heap,
+ * gives back the slabs whose blocks are then all in the bin, and moves the
+ * other blocks back to the transfer cache in whole batches, keeping at
+ * least keep blocks in the bin.
+ * params: heap of the calling thread, size class index, blocks to keep.
+ * returns: number of slabs released.
+ */
+unsigned int sweep_small_class(thread_heap *heap, unsigned int size_class,
+                               unsigned int keep);
+
+
+
+
+/*
+ * Pushes a batch of TRANSFER_BATCH linked blocks on the transfer cache of a
+ * class.
+ * params: size class index, first block of the batch.
+ */
+void transfer_push(unsigned int size_class, free_block *batch);
+
+
+
+
+/*
+ * Takes a batch of TRANSFER_BATCH linked blocks out of the transfer cache
+ * of a class.
+ * params: size class index.
+ * returns: first block of the batch, NULL if the cache is empty.
+ */
+free_block * transfer_pop(unsigned int size_class);
+
+
+
+
+/*
+ * Moves TRANSFER_BATCH blocks from the top of a bin to the transfer cache.
+ * params: heap of the calling thread, size class index (bin holds more
+ *         than TRANSFER_BATCH blocks).
+ */
+void flush_bin(thread_heap *heap, unsigned int size_class);
+
+
+
+
+/*
+ * Carves the next batch of never used blocks from the current slab of a
+ * class into its empty bin. The batch does not go past the end of the
+ * slab, a new slab is only taken when the current one is used up.
+ * params: heap of the calling thread, size class index.
+ * returns: number of blocks added, 0 on failure.
+ */
+unsigned int refill_bin(thread_heap *heap, unsigned int size_class);
+
+
+
+
+/*
+ * Fills the bins of the PREPOPULATE_CLASSES smallest classes of a new heap.
+ * params: new heap of the calling thread.
+ */
+void prepopulate_bins(thread_heap *heap);
+
+
+
+
+/*
+ * Allocate memory from heap area. For memory request of sizes <= 3584, blocks
+ * are allocated from slabs of the size class.
+ * params : heap of the calling thread, size class index, set to the number of
+ *          leading bytes of the block that may not be zero.
+ * returns: pointer to allocated area.
+ */
+void * heap_allocate(thread_heap *heap, unsigned int size_class,
+                     size_t *dirty_size);
+
+
+
+
+/*
+ * Maps a large block size to its bin in large_bins.
+ * params: size in bytes (> SMALL_SIZE_MAX), bin row and column to set.
+ */
+void large_bin_index(size_t size, unsigned int *fl, unsigned int *sl);
+
+
+
+
+/*
+ * Adds a free large block to the index.
+ * params: bins of the owner heap, block header.
+ */
+void large_bin_insert(large_bins *bins, block_info *block);
+
+
+
+
+/*
+ * Finds best fit block from bin_large. On memory request > 3584, first
+ * it is checked if any of large free memory chunks fits to request.
+ * The request is looked up as the block size a miss would create
+ * (large_block_size()).
+ *
+ * params: heap of the calling thread, size of block to allocate.
+ * returns: pointer to best fitting block, NULL on failure.
+ */
+void * find_best_fit_from_bin_large(thread_heap *heap, size_t size);
+
+
+
+/*
+ * maps new memory address using mmap system call for size request > 256 KB.
+ * params: requested size in bytes.
+ * returns: pointer to block allocated., NULL on failure.
+ */
+void * mmap_new_memory(size_t size);
+
+
+
+
+/*
+ * returns the bytes of the page run of a medium request, header included.
+ * params: requested size (SMALL_SIZE_MAX < size <= MEDIUM_SIZE_MAX).
+ */
+size_t medium_run_size(size_t size);
+
+
+
+
+/*
+ * returns the usable size of the block malloc creates for a request
+ * > SMALL_SIZE_MAX when nothing is reused: a medium run or whole pages,
+ * minus the header.
+ * params: requested size (> SMALL_SIZE_MAX).
+ * returns: block size, 0 if the size can't be served.
+ */
+size_t large_block_size(size_t size);
+
+
+
+
+/*
+ * Carves a medium block from the thread heap.
+ * params: heap of the calling thread, requested size (<= MEDIUM_SIZE_MAX),
+ *         set to the number of leading bytes of the block that may not be
+ *         zero.
+ * returns: pointer to the block, NULL on failure.
+ */
+void * alloc_medium(thread_heap *heap, size_t size, size_t *dirty_size);
+
+
+
+
+/*
+ * Maps a large block aligned to alignment. The header goes just before the
+ * aligned address, the bytes mapped in front of it are kept in lead.
+ * params: requested size in bytes, alignment (power of two > 16).
+ * returns: pointer to block allocated., NULL on failure.
+ */
+void * mmap_aligned_memory(size_t size, size_t alignment);
+
+
+
+
+/*
+ * Takes a medium run for an aligned request and moves the header forward,
+ * so the block starts at the alignment inside the run. The bytes in front
+ * of the header are kept in lead.
+ * params: heap of the calling thread, requested size, alignment (power of
+ *         two, sizeof(block_info) < alignment <= SLAB_SIZE).
+ * returns: pointer to the block, NULL on failure.
+ */
+void * alloc_medium_aligned(thread_heap *heap, size_t size, size_t alignment);
+
+
+
+/*
+ * Puts a freed large block in bin_large of its owner heap, or gives it back
+ * to the system if it is too big or the bin is full. Mapped blocks drop
+ * their pages while cached, unless the purge thread runs.
+ * Must be called by the owning thread.
+ * params: owner heap, block header of the freed block.
+ */
+void cache_large_block(thread_heap *heap, block_info *block);
+
+
+
+
+/*
+ * Gives back the blocks cached in bin_large for dirty_decay_ms or more.
+ * Must be called by the owning thread.
+ * params: owner heap, current time in ms.
+ */
+void decay_large_bins(thread_heap *heap, unsigned long now);
+
+
+
+
+/*
+ * returns the CLOCK_MONOTONIC time in milliseconds.
+ */
+unsigned long now_ms(void);
+
+
+
+
+/*
+ * returns the huge cache bucket of a block size.
+ * params: block size (> SMALL_SIZE_MAX).
+ */
+unsigned int huge_bucket(size_t size);
+
+
+
+
+/*
+ * Removes an entry from its bucket and the age list. Called with
+ * global_heap_mutex held.
+ * params: entry.
+ */
+void huge_cache_unlink(huge_entry *entry);
+
+
+
+
+/*
+ * Takes the entries out of the huge cache that are too old, or the oldest
+ * ones while it holds more than huge_cache_max bytes. Called with
+ * global_heap_mutex held.
+ * params: current time in ms.
+ * returns: the entries taken out, linked through next.
+ */
+huge_entry * huge_cache_expire(unsigned long now);
+
+
+
+
+/*
+ * Unmaps entries taken out of the huge cache.
+ * params: heap of the calling thread (may be NULL), entries linked through
+ *         next.
+ */
+void release_huge_entries(thread_heap *heap, huge_entry *entry);
+
+
+
+
+/*
+ * Keeps a freed huge block in the huge cache, or unmaps it if it can't be
+ * cached.
+ * params: heap of the calling thread (may be NULL), block header.
+ */
+void cache_huge_block(thread_heap *heap, block_info *block);
+
+
+
+
+/*
+ * Takes a block of at least size bytes from the huge cache.
+ * params: heap of the calling thread, requested size.
+ * returns: pointer to the block, NULL if none fits.
+ */
+void * huge_cache_get(thread_heap *heap, size_t size);
+
+
+
+
+/*
+ * Unmaps a large block, or gives the pages of a medium block back to
+ * free_slices. In per-CPU mode a heap passed is locked, the work waits for
+ * unlock_heap().
+ * params: heap of the calling thread (for statistics, may be NULL),
+ *         block header.
+ */
+void release_large_block(thread_heap *heap, block_info *block);
+
+
+
+
+/*
+ * Reads a size tunable from the environment.
+ * params: variable name, value used when it is unset or invalid.
+ * returns: value of the tunable.
+ */
+size_t read_tunable(const char *name, size_t default_value);
+
+
+
+
+/*
+ * Reads the free fill policy from MALLOC_FREE_FILL.
+ * params: NONE.
+ * returns: FREE_FILL_NONE, FREE_FILL_ZERO or FREE_FILL_JUNK.
+ */
+int read_free_fill(void);
+
+
+
+
+/*
+ * Writes the free fill pattern over a block being freed.
+ * params: block address, number of bytes to fill.
+ * returns: NONE.
+ */
+void fill_freed_block(void *p, size_t size);
+
+
+
+
+/*
+ * Performs allocation for request > 3584 bytes.
+ * params : heap of the calling thread, requested memory size, set to the
+ *          number of leading bytes of the block that may not be zero.
+ * returns: pointer to allocated memory. NULL on failure.
+ */
+void * alloc_large(thread_heap *heap, size_t size, size_t *dirty_size);
+
+
+
+
+/*
+ * Carves the next thread heap out of the current chunk with a fetch-add on
+ * its frontier. global_heap_mutex is only taken to map a new chunk or to
+ * commit pages.
+ * params: bytes needed (<= CHUNK_SIZE - SLAB_SIZE), set to the range end.
+ * returns: start of the new thread heap, NULL on failure.
+ */
+void * carve_thread_heap(size_t size, void **end);
+
+
+
+
+/*
+ * Sets the boundary tags of a free run to its length in pages, or clears
+ * them.
+ * params: page aligned range inside one chunk, length or 0.
+ */
+void set_run_tags(void *start, void *end, unsigned short pages);
+
+
+
+
+/*
+ * Removes a free run from free_slices. Called with global_heap_mutex held.
+ * params: run to remove.
+ */
+void unlink_free_run(heap_slice *slice);
+
+
+
+
+/*
+ * Gives a range of pages back to free_slices, merged with the free runs
+ * right before and after it. Called with global_heap_mutex held.
+ * params: page aligned range inside one chunk, RUN_CLEAN if it is zero
+ *         filled, RUN_MUZZY or RUN_DIRTY, time in ms it got that state.
+ * returns: the free run the range ended up in.
+ */
+heap_slice * put_free_run(void *start, void *end, int state,
+                          unsigned long changed_at);
+
+
+
+
+/*
+ * Takes memory for a thread heap from free_slices, from the first run big
+ * enough, or with transparent_hugepages from the one in the fullest chunk.
+ * Called with global_heap_mutex held.
+ * params: bytes needed, set to the end of the range, set to the state of
+ *         the run it came from.
+ * returns: start of the range, NULL if no free run is big enough.
+ */
+void * take_free_run(size_t size, void **end, int *state);
+
+
+
+
+/*
+ * Decommits a free run in place and marks it RUN_CLEAN. Called with
+ * global_heap_mutex held.
+ * params: run in free_slices.
+ */
+void decommit_free_run(heap_slice *slice);
+
+
+
+
+/*
+ * Checks if the free pages of a chunk may be given back to the kernel,
+ * which breaks up its huge page with transparent_hugepages.
+ * params: pointer inside the chunk.
+ * returns: 1 if they may, 0 if the huge page is kept whole.
+ */
+int may_break_hugepage(void *p);
+
+
+
+
+/*
+ * Decommits the oldest free runs that are not RUN_CLEAN, and whose chunk
+ * may_break_hugepage() allows, until free_dirty_bytes is down to keep.
+ * The syscalls run without global_heap_mutex.
+ * params: dirty bytes to keep.
+ */
+void decommit_dirty_runs(size_t keep);
+
+
+
+
+/*
+ * Gives pages no longer used by a thread heap back to free_slices, dirty.
+ * Without background purging the dirty runs are decommitted in one pass
+ * once free_dirty_bytes passes dirty_purge_at.
+ * In per-CPU mode a heap passed is locked, the work waits for
+ * unlock_heap().
+ * params: heap of the calling thread (may be NULL), page aligned range
+ *         inside one chunk.
+ */
+void release_heap_pages(thread_heap *heap, void *start, void *end);
+
+
+
+
+/*
+ * Gives several ranges of the same length back to free_slices with one
+ * lock of global_heap_mutex, like release_heap_pages().
+ * params: heap of the calling thread (may be NULL), starts of page aligned
+ *         ranges inside a chunk each, their number, their length.
+ */
+void release_heap_ranges(thread_heap *heap, void **starts,
+                         unsigned int count, size_t length);
+
+
+
+
+/*
+ * Moves the free runs whose decay time passed one state towards
+ * RUN_CLEAN, with MADV_FREE or MADV_DONTNEED.
+ * params: current time in ms.
+ */
+void purge_free_runs(unsigned long now);
+
+
+
+
+/*
+ * Body of the background purging thread.
+ * params: unused.
+ * returns: never.
+ */
+void * purge_thread(void *arg);
+
+
+
+
+/*
+ *  Creates a memory block from unused heap.
+ *  params: requested memory size in bytes, a multiple of SLAB_SIZE.
+ *  returns: pointer to allocated memory chunk (SLAB_SIZE aligned).
+ *           NULL on failure.
+ */
+void * block_from_unused_heap(size_t size);
+
+
+
+
+/*
+ * Allocates memory from the heap of the calling thread and reports how much
+ * of it may hold old data, so calloc can skip clearing fresh pages.
+ * params: requested memory size, set to the number of leading bytes of the
+ *         block that may not be zero.
+ * returns: pointer to allocated memory. NULL on failure.
+ */
+void * allocate(size_t size, size_t *dirty_size);
+
+
+
+
+/*
+ * Allocates the memory.
+ */
+void * malloc(size_t);
+
+
+
+
+/*
+ * Frees a block whose kind is already known.
+ * params: address to pointer to be freed, non zero if it is a slab block.
+ * returns: NONE.
+ */
+void release_block(void *p, int small);
+
+
+
+
+/*
+ * Marks a large block free, fills it and drops the pages of a mapped
+ * block that goes to bin_large. Needs no heap.
+ * params: block header.
+ * returns: 0 if the block was already free, 1 otherwise.
+ */
+int retire_large_block(block_info *block);
+
+
+
+
+/*
+ * Frees a block into a heap. Small blocks go to the bin of the heap, large
+ * blocks, retired first (retire_large_block()), to the heap if it owns
+ * them, otherwise they are queued on remote_free of their owner heap.
+ * params: heap of the calling thread (may be NULL), address to pointer to
+ *         be freed, non zero if it is a slab block.
+ * returns: NONE.
+ */
+void heap_free(thread_heap *heap, void *p, int small);
+
+
+
+
+/*
+ * Free up the memory allocated at pointer p.
+ * params: address to pointer to be freed.
+ * returns: NONE.
+ */
+void free(void *p);
+
+
+
+
+/*
+ * Returns the number of usable bytes in the block at p.
+ * params: pointer returned by malloc (may be NULL).
+ * returns: usable size in bytes, 0 for NULL.
+ */
+size_t malloc_usable_size(void *p);
+
+
+
+
+/*
+ * Allocate size of size bytes for nmemb. Initialize with null bytes. Only
+ * the part of the block that may hold old data is cleared.
+ * params: total number of elements of size 'size' to be allocated. and size
+ *         to allocate.
+ * returns: pointer to allocated memory on success. NULL with errno ENOMEM
+ *          on failure or when nmemb * size overflows.
+ */
+void * calloc(size_t nmemb, size_t size);
+
+
+
+
+/*
+ * Resizes a large block with mremap, moving its pages if needed.
+ * params: pointer to a large block, new size (> SMALL_SIZE_MAX).
+ * returns: pointer to the resized block, NULL on failure (ptr is kept).
+ */
+void * resize_large_block(void *ptr, size_t size);
+
+
+
+
+/*
+ * reallocates the pointer with new size size and copies the old data to new
+ * location.
+ * params: pointer to reallocate. and new size.
+ * returns: pointer to new allocated memory chunk.
+ */
+void * realloc(void *ptr, size_t size);
+
+
+
+
+/*
+ * Allocates size bytes aligned to alignment. Small requests come from a
+ * naturally aligned size class, others up to a page alignment from a
+ * medium run, the rest from an aligned mapping.
+ * params: alignment (power of two), requested size.
+ * returns: pointer to allocated memory. NULL on failure.
+ */
+void * aligned_allocate(size_t alignment, size_t size);
+
+
+
+
+/* aligns memory.
+ * params: alignment (power of two), requested size.
+ * returns: pointer to allocated memory. NULL with errno EINVAL for a bad
+ *          alignment, ENOMEM on failure.
+ */
+void * memalign(size_t alignment, size_t s);
+
+
+
+
+/*
+ * POSIX aligned allocation.
+ * params: where to store the pointer, alignment (power of two multiple of
+ *         sizeof(void *)), requested size.
+ * returns: 0 on success, EINVAL for a bad alignment, ENOMEM on failure.
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size);
+
+
+
+
+/*
+ * C11 aligned allocation, same as memalign.
+ */
+void * aligned_alloc(size_t alignment, size_t size);
+
+
+
+
+/*
+ * Allocates page aligned memory.
+ */
+void * valloc(size_t size);
+
+
+
+
+/*
+ * Allocates page aligned memory of whole pages.
+ */
+void * pvalloc(size_t size);
+
+
+
+
+/*
+ * Gives the pages of medium blocks cached in bin_large of a heap back to the
+ * kernel, but the one holding block_info.
+ * params: heap of the calling thread.
+ * returns: 1 if pages were released, 0 otherwise.
+ */
+int trim_large_bins(thread_heap *heap);
+
+
+
+
+/*
+ * Gives back what a heap holds: sweeps every small class, so slabs whose
+ * blocks are all in its bins or the transfer caches are released, and
+ * decommits the medium blocks cached in bin_large.
+ * params: heap owned by the calling thread, locked or taken off
+ *         abandoned_heaps.
+ * returns: 1 if memory was released, 0 otherwise.
+ */
+int trim_heap(thread_heap *heap);
+
+
+
+
+/*
+ * Releases free memory to the system: trims the heaps (see trim_heap()),
+ * unmaps chunks that are entirely free, decommits free runs and empties
+ * the huge cache.
+ * params: bytes of free runs to keep, most recently freed first.
+ * returns: 1 if memory was released, 0 otherwise.
+ */
+int malloc_trim(size_t pad);
 
 
 
@@ -0,0 +1,28 @@
+/*
+ * Helpers shared by the test programs of make check.
+ */
+#ifndef _TEST_H
+#define _TEST_H 1
+
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* small, multi-page slab, medium, mapped and huge requests. */
+static const size_t sizes[] = {1, 8, 16, 100, 512, 513, 3584, 3585, 5000,
+                               40000, 262112, 262113, 300000, 1 << 20,
+                               5 << 20};
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+/* resident set size of the process in bytes. */
+static inline size_t rss(void)
+{
+  unsigned long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  assert(f != NULL);
+  assert(fscanf(f, "%lu %lu", &pages, &resident) == 2);
+  fclose(f);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * Checks the allocation API beyond malloc and free: malloc_usable_size,
+ * nallocx and free_sized. Run with libmalloc.so preloaded (make check).
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "libmalloc.h"
+#include "test.h"
+
+/* not in glibc, weak so the test still links without libmalloc.so. */
+#pragma weak nallocx
+#pragma weak free_sized
+#pragma weak free_aligned_sized
+
+static void test_usable_size(void)
+{
+  assert(malloc_usable_size(NULL) == 0);
+  for(size_t s = 1; s < 300000; s += (s < 4096 ? 1 : 97))
+  {
+    size_t n = nallocx(s, 0);
+    char *p = malloc(s);
+    assert(p != NULL);
+    size_t usable = malloc_usable_size(p);
+
+    // the whole usable size can be written.
+    assert(n >= s);
+    assert(usable >= n);
+    if(s <= 3584)
+    {
+      assert(usable == n);
+    }
+    memset(p, 0xa5, usable);
+    free(p);
+  }
+  assert(nallocx(SIZE_MAX, 0) == 0);
+  for(int la = 4; la <= 16; la++)
+  {
+    assert(nallocx(100, MALLOCX_LG_ALIGN(la)) >= 100);
+  }
+  printf("malloc_usable_size, nallocx: ok\n");
+}
+
+static void test_free_sized(void)
+{
+  free_sized(NULL, 0);
+  for(int round = 0; round < 2; round++)
+  {
+    for(size_t i = 0; i < NUM_SIZES; i++)
+    {
+      char *p = malloc(sizes[i]);
+      assert(p != NULL);
+      memset(p, 1, sizes[i]);
+      free_sized(p, sizes[i]);
+
+      // a block grown by realloc is freed with its new size.
+      p = realloc(malloc(1), sizes[i]);
+      assert(p != NULL);
+      memset(p, 2, sizes[i]);
+      free_sized(p, sizes[i]);
+    }
+    for(size_t alignment = 16; alignment <= 65536; alignment *= 2)
+    {
+      for(size_t i = 0; i < NUM_SIZES; i++)
+      {
+        char *p = aligned_alloc(alignment, sizes[i]);
+        assert(p != NULL);
+        assert((uintptr_t)p % alignment == 0);
+        memset(p, 3, sizes[i]);
+        free_aligned_sized(p, alignment, sizes[i]);
+      }
+    }
+  }
+  printf("free_sized, free_aligned_sized: ok\n");
+}
+
+int main(int argc, char **argv)
+{
+  if(NULL == nallocx || NULL == free_sized || NULL == free_aligned_sized)
+  {
+    printf("run with LD_PRELOAD=libmalloc.so\n");
+    return 1;
+  }
+  test_usable_size();
+  test_free_sized();
+  return 0;
+}
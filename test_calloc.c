@@ -0,0 +1,51 @@
+/*
+ * Checks that calloc fails on overflowing sizes and hands out zeroed
+ * memory, also where freed blocks held data. Run with libmalloc.so
+ * preloaded (make check).
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+
+static void test_calloc(void)
+{
+  // volatile, so the compiler doesn't see the overflow coming.
+  volatile size_t half = SIZE_MAX / 2 + 2, big = (size_t)1 << 32;
+
+  errno = 0;
+  assert(calloc(half, 2) == NULL);
+  assert(errno == ENOMEM);
+  errno = 0;
+  assert(calloc(big, big) == NULL);
+  assert(errno == ENOMEM);
+
+  // memory that held data comes back zeroed.
+  for(int round = 0; round < 3; round++)
+  {
+    for(size_t i = 0; i < NUM_SIZES; i++)
+    {
+      char *p = malloc(sizes[i]);
+      assert(p != NULL);
+      memset(p, 0xff, sizes[i]);
+      free(p);
+      p = calloc(1, sizes[i]);
+      assert(p != NULL);
+      for(size_t k = 0; k < sizes[i]; k++)
+      {
+        assert(p[k] == 0);
+      }
+      free(p);
+    }
+  }
+  printf("calloc: ok\n");
+}
+
+int main(int argc, char **argv)
+{
+  test_calloc();
+  return 0;
+}
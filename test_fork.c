@@ -0,0 +1,73 @@
+/*
+ * Forks while other threads allocate and free, so fork() often happens with
+ * threads waiting on the heap locks. The child allocates too. A hang is
+ * caught by alarm(). Run with libmalloc.so preloaded (make check).
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define THREADS 6
+#define FORKS   200
+
+static volatile int stop = 0;
+
+static void *worker(void *arg)
+{
+  unsigned int seed = (unsigned long)arg;
+  void *p[64] = {NULL};
+
+  while(!stop)
+  {
+    int i = rand_r(&seed) % 64;
+
+    // small, medium and mapped sizes, the last two take the global mutex.
+    size_t size = 16 + rand_r(&seed) % (rand_r(&seed) % 4 ? 4000 : 300000);
+    free(p[i]);
+    p[i] = malloc(size);
+    assert(p[i] != NULL);
+    memset(p[i], i, size < 256 ? size : 256);
+  }
+  for(int i = 0; i < 64; i++)
+  {
+    free(p[i]);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  pthread_t threads[THREADS];
+
+  alarm(60);
+  for(long i = 0; i < THREADS; i++)
+  {
+    assert(pthread_create(&threads[i], NULL, worker, (void *)i) == 0);
+  }
+  for(int i = 0; i < FORKS; i++)
+  {
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if(0 == pid)
+    {
+      void *p = malloc(100000);
+      free(malloc(100));
+      free(p);
+      _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+  }
+  stop = 1;
+  for(int i = 0; i < THREADS; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  printf("fork under contention: ok\n");
+  return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * Checks that a freed large block is found by the next request of the same
+ * size. Run with libmalloc.so preloaded (make check).
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* a freed large block sits just below a bin boundary, the lookup used to
+   skip its bin and miss it for about a quarter of the sizes. */
+static void test_large_reuse(void)
+{
+  int tried = 0, missed = 0;
+
+  for(size_t s = 513; s < 200000; s += (s < 8192 ? 7 : 251))
+  {
+    void *p = malloc(s);
+    assert(p != NULL);
+    free(p);
+    void *q = malloc(s);
+    assert(q != NULL);
+    if(p != q)
+    {
+      missed++;
+    }
+    tried++;
+    free(q);
+  }
+  printf("large reuse: %d of %d sizes missed\n", missed, tried);
+  assert(missed == 0);
+}
+
+int main(int argc, char **argv)
+{
+  test_large_reuse();
+  return 0;
+}
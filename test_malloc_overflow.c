@@ -0,0 +1,36 @@
+/*
+ * Checks that sizes whose page rounding overflows fail with ENOMEM instead
+ * of getting a small block. Run with libmalloc.so preloaded (make check).
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* volatile, so the compiler doesn't see the overflow coming. */
+static volatile size_t huge_sizes[] = {SIZE_MAX, SIZE_MAX - 20,
+                                       SIZE_MAX - 4096, SIZE_MAX / 2 + 1};
+#define NUM_HUGE_SIZES (sizeof(huge_sizes) / sizeof(huge_sizes[0]))
+
+/* malloc(SIZE_MAX) used to return a one page block. */
+static void test_malloc_overflow(void)
+{
+  for(size_t i = 0; i < NUM_HUGE_SIZES; i++)
+  {
+    errno = 0;
+    assert(malloc(huge_sizes[i]) == NULL);
+    assert(errno == ENOMEM);
+
+    errno = 0;
+    assert(aligned_alloc(4096, huge_sizes[i]) == NULL);
+    assert(errno == ENOMEM);
+  }
+  printf("malloc overflow: ok\n");
+}
+
+int main(int argc, char **argv)
+{
+  test_malloc_overflow();
+  return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Checks that malloc_trim gives freed memory back to the system and that
+ * the trimmed memory is usable again. Run with libmalloc.so preloaded
+ * (make check).
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "test.h"
+
+static void test_malloc_trim(void)
+{
+  enum { COUNT = 2000, SIZE = 40000 };
+  static void *p[COUNT];
+
+  for(int i = 0; i < COUNT; i++)
+  {
+    p[i] = malloc(SIZE);
+    assert(p[i] != NULL);
+    memset(p[i], 1, SIZE);
+  }
+  for(int i = 0; i < COUNT; i++)
+  {
+    free(p[i]);
+  }
+  size_t before = rss();
+  assert(malloc_trim(0) == 1);
+  size_t after = rss();
+
+  /* part of the 80 MB freed may be decommitted already, at least a
+     quarter of it is left for malloc_trim() to give back. */
+  printf("malloc_trim: RSS %zu KB -> %zu KB\n", before >> 10, after >> 10);
+  assert(after + ((size_t)COUNT * SIZE / 4) < before);
+
+  // the trimmed memory is usable again.
+  for(int i = 0; i < COUNT; i++)
+  {
+    p[i] = calloc(1, SIZE);
+    assert(p[i] != NULL);
+    assert(((char *)p[i])[SIZE - 1] == 0);
+  }
+  for(int i = 0; i < COUNT; i++)
+  {
+    free(p[i]);
+  }
+  printf("malloc_trim: ok\n");
+}
+
+int main(int argc, char **argv)
+{
+  test_malloc_trim();
+  return 0;
+}
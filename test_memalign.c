@@ -0,0 +1,68 @@
+/*
+ * Checks posix_memalign, aligned_alloc, valloc and pvalloc: alignment of
+ * every size class, invalid arguments and size 0. Run with libmalloc.so
+ * preloaded (make check).
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "test.h"
+
+static void test_posix_memalign(void)
+{
+  void *p = NULL;
+
+  /* size 0 gets a block of its own, not the start of the next one. Before
+     anything is freed, so the blocks come from new runs rather than
+     bin_large. */
+  for(size_t alignment = 32; alignment <= (1 << 21); alignment *= 2)
+  {
+    void *zero[4] = {NULL, aligned_alloc(alignment, 0), valloc(0), pvalloc(0)};
+    assert(posix_memalign(&zero[0], alignment, 0) == 0);
+    for(int i = 0; i < 4; i++)
+    {
+      assert(zero[i] != NULL);
+      assert(malloc_usable_size(zero[i]) >= 1);
+      char *q = malloc(5000);
+      assert(q != NULL);
+      assert((char *)zero[i] < q - 32 || (char *)zero[i] >= q + 5000);
+      size_t usable = malloc_usable_size(q);
+      memset(q, 0x5a, 5000);
+      free(zero[i]);
+      assert(malloc_usable_size(q) == usable);
+      free(q);
+    }
+  }
+
+  assert(posix_memalign(&p, 0, 16) == EINVAL);
+  assert(posix_memalign(&p, sizeof(void *) / 2, 16) == EINVAL);
+  assert(posix_memalign(&p, 24, 16) == EINVAL);
+  assert(posix_memalign(&p, 4096, SIZE_MAX - 100) == ENOMEM);
+
+  for(size_t alignment = sizeof(void *); alignment <= (1 << 21);
+      alignment *= 2)
+  {
+    for(size_t i = 0; i < NUM_SIZES; i++)
+    {
+      p = NULL;
+      assert(posix_memalign(&p, alignment, sizes[i]) == 0);
+      assert(p != NULL);
+      assert((uintptr_t)p % alignment == 0);
+      assert(malloc_usable_size(p) >= sizes[i]);
+      memset(p, 0x5a, sizes[i]);
+      free(p);
+    }
+  }
+
+  printf("posix_memalign: ok\n");
+}
+
+int main(int argc, char **argv)
+{
+  test_posix_memalign();
+  return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Checks that realloc to a size whose page rounding overflows fails with
+ * ENOMEM and keeps the block. Run with libmalloc.so preloaded (make check).
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* volatile, so the compiler doesn't see the overflow coming. */
+static volatile size_t huge_sizes[] = {SIZE_MAX, SIZE_MAX - 20,
+                                       SIZE_MAX - 4096, SIZE_MAX / 2 + 1};
+#define NUM_HUGE_SIZES (sizeof(huge_sizes) / sizeof(huge_sizes[0]))
+
+/* realloc(p, SIZE_MAX - 20) used to shrink the mapping to one page and
+   return p with the data gone. */
+static void test_realloc_overflow(void)
+{
+  static const size_t sizes[] = {100, 5000, 40000, 1 << 20, 5 << 20};
+
+  for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+  {
+    unsigned char *p = malloc(sizes[i]);
+    assert(p != NULL);
+    memset(p, 7, sizes[i]);
+    for(size_t j = 0; j < NUM_HUGE_SIZES; j++)
+    {
+      errno = 0;
+      assert(realloc(p, huge_sizes[j]) == NULL);
+      assert(errno == ENOMEM);
+    }
+
+    // p is kept whole.
+    for(size_t k = 0; k < sizes[i]; k++)
+    {
+      assert(p[k] == 7);
+    }
+    free(p);
+  }
+  printf("realloc overflow: ok\n");
+}
+
+int main(int argc, char **argv)
+{
+  test_realloc_overflow();
+  return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * Checks that blocks freed by another thread go back to the heap they came
+ * from: a producer/consumer pipeline keeps RSS flat. Run with libmalloc.so
+ * preloaded (make check).
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+
+#define BLOCKS     200000
+#define BLOCK_SIZE 64
+
+static void *blocks[BLOCKS];
+static pthread_barrier_t barrier;
+
+static void *consumer(void *arg)
+{
+  int rounds = *(int *)arg;
+
+  for(int r = 0; r < rounds; r++)
+  {
+    pthread_barrier_wait(&barrier);
+    for(int i = 0; i < BLOCKS; i++)
+    {
+      free(blocks[i]);
+    }
+    pthread_barrier_wait(&barrier);
+  }
+  return NULL;
+}
+
+/* the main thread allocates, another thread frees. 2M blocks pass through
+   the pipeline, about 125 MB, and used to all stay with the consumer. */
+static void test_producer_consumer(void)
+{
+  int rounds = 10;
+  pthread_t thread;
+  size_t start = 0;
+
+  pthread_barrier_init(&barrier, NULL, 2);
+  assert(pthread_create(&thread, NULL, consumer, &rounds) == 0);
+  for(int r = 0; r < rounds; r++)
+  {
+    for(int i = 0; i < BLOCKS; i++)
+    {
+      blocks[i] = malloc(BLOCK_SIZE);
+      assert(blocks[i] != NULL);
+      memset(blocks[i], 1, BLOCK_SIZE);
+    }
+    if(0 == r)
+    {
+      start = rss();
+    }
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+  }
+  pthread_join(thread, NULL);
+  pthread_barrier_destroy(&barrier);
+
+  size_t end = rss();
+  printf("producer/consumer: RSS %zu KB -> %zu KB\n", start >> 10, end >> 10);
+  assert(end < start + (16 << 20));
+}
+
+int main(int argc, char **argv)
+{
+  test_producer_consumer();
+  return 0;
+}
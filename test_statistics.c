@@ -0,0 +1,50 @@
+/*
+ * Checks that get_malloc_statistics() counts the requests of the calling
+ * thread. Run with libmalloc.so preloaded (make check).
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "libmalloc.h"
+
+/* not in glibc, weak so the test still links without libmalloc.so. */
+#pragma weak get_malloc_statistics
+
+static void test_statistics(void)
+{
+  malloc_statistics before, after;
+  void *p[1000];
+
+  get_malloc_statistics(&before);
+  for(int i = 0; i < 1000; i++)
+  {
+    p[i] = malloc(64);
+    assert(p[i] != NULL);
+  }
+  for(int i = 0; i < 1000; i++)
+  {
+    free(p[i]);
+  }
+  void *huge = malloc(8 << 20);
+  assert(huge != NULL);
+  get_malloc_statistics(&after);
+  free(huge);
+
+  assert(after.total_allocation_request - before.total_allocation_request >=
+         1001);
+  assert(after.total_free_request - before.total_free_request >= 1000);
+  assert(after.total_mmap_size_allocated - before.total_mmap_size_allocated >=
+         (8 << 20));
+  printf("get_malloc_statistics: ok\n");
+}
+
+int main(int argc, char **argv)
+{
+  if(NULL == get_malloc_statistics)
+  {
+    printf("run with LD_PRELOAD=libmalloc.so\n");
+    return 1;
+  }
+  test_statistics();
+  return 0;
+}
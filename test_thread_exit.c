@@ -0,0 +1,55 @@
+/*
+ * Checks that the memory of exited threads is reused: thread churn keeps
+ * RSS flat. Run with libmalloc.so preloaded (make check).
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+
+static void *short_thread(void *arg)
+{
+  void *p[64];
+
+  for(int i = 0; i < 64; i++)
+  {
+    p[i] = malloc(16 + i * 97);
+    assert(p[i] != NULL);
+    memset(p[i], 1, 16 + i * 97);
+  }
+  for(int i = 0; i < 64; i++)
+  {
+    free(p[i]);
+  }
+  return NULL;
+}
+
+/* every thread used to leave about 92 KB behind when it exited. */
+static void test_thread_churn(void)
+{
+  enum { THREADS = 2000 };
+  size_t start = 0;
+
+  for(int i = 0; i < THREADS; i++)
+  {
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, short_thread, NULL) == 0);
+    pthread_join(thread, NULL);
+    if(100 == i)
+    {
+      start = rss();
+    }
+  }
+
+  size_t end = rss();
+  printf("thread churn: RSS %zu KB -> %zu KB\n", start >> 10, end >> 10);
+  assert(end < start + (8 << 20));
+}
+
+int main(int argc, char **argv)
+{
+  test_thread_churn();
+  return 0;
+}
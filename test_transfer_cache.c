@@ -0,0 +1,71 @@
+/*
+ * Checks that blocks freed by one thread do not pile up out of reach of
+ * the others: a thread that frees a lot and then idles keeps RSS flat. Run
+ * with libmalloc.so preloaded (make check).
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+
+#define BLOCKS     200000
+#define BLOCK_SIZE 64
+
+static void *blocks[BLOCKS];
+static pthread_barrier_t barrier;
+
+static void allocate_blocks(void)
+{
+  for(int i = 0; i < BLOCKS; i++)
+  {
+    blocks[i] = malloc(BLOCK_SIZE);
+    assert(blocks[i] != NULL);
+    memset(blocks[i], 1, BLOCK_SIZE);
+  }
+}
+
+static void free_blocks(void)
+{
+  for(int i = 0; i < BLOCKS; i++)
+  {
+    free(blocks[i]);
+  }
+}
+
+static void *idle_freer(void *arg)
+{
+  allocate_blocks();
+  free_blocks();
+  pthread_barrier_wait(&barrier);
+  pthread_barrier_wait(&barrier);
+  return NULL;
+}
+
+/* blocks freed by a thread that then idles used to stay in its bins, so
+   200k allocations of another thread took 13 MB of new memory. */
+static void test_idle_freer(void)
+{
+  pthread_t thread;
+
+  pthread_barrier_init(&barrier, NULL, 2);
+  assert(pthread_create(&thread, NULL, idle_freer, NULL) == 0);
+  pthread_barrier_wait(&barrier);
+  size_t start = rss();
+  allocate_blocks();
+  size_t end = rss();
+  pthread_barrier_wait(&barrier);
+  pthread_join(thread, NULL);
+  pthread_barrier_destroy(&barrier);
+  free_blocks();
+
+  printf("idle freer: RSS %zu KB -> %zu KB\n", start >> 10, end >> 10);
+  assert(end < start + (4 << 20));
+}
+
+int main(int argc, char **argv)
+{
+  test_idle_freer();
+  return 0;
+}